@@ -1,13 +1,16 @@
 import _acurl
 import threading
 import asyncio
+import io
+import itertools
+import os
 import ujson
-from collections import namedtuple
+from collections import namedtuple, deque
 import time
 from urllib.parse import urlparse
 
-class RequestError(Exception):
-    pass
+RequestError = _acurl.RequestError
+RequestTimeout = _acurl.RequestTimeout
 
 
 _FALSE_TRUE = ['FALSE', 'TRUE']
@@ -174,8 +177,13 @@ class Request:
         return self._data
 
 
+# A redirect followed by the event loop: its status, the URL it was fetched from, where it pointed
+# and how long it took in seconds
+Redirect = namedtuple('Redirect', 'status_code url redirect_url total_time')
+
+
 class Response:
-    __slots__ = '_req _resp _start_time _redirect_url _prev _body _text _header _headers_tuple _headers _encoding _json'.split()
+    __slots__ = '_req _resp _start_time _redirect_url _prev _history _body _text _header _headers_tuple _headers _encoding _json'.split()
 
     def __init__(self, req, resp, start_time):
         self._req = req
@@ -184,6 +192,9 @@ class Response:
 
     @property
     def request(self):
+        """The Request that was sent, made from the arguments the first time it is looked at"""
+        if not isinstance(self._req, Request):
+            self._req = _request_record(*self._req)
         return self._req
 
     @property
@@ -238,13 +249,28 @@ class Response:
     def download_size(self):
         return self._resp.get_size_download()
 
+    @property
+    def content_length(self):
+        """The Content-Length the server sent, None if it didn't"""
+        return self._resp.get_content_length()
+
+    @property
+    def redirect_count(self):
+        return self._resp.get_redirect_count()
+
+    @property
+    def num_connects(self):
+        """New connections the transfer had to make, 0 when it reused one"""
+        return self._resp.get_num_connects()
+
     @property
     def primary_ip(self):
         return self._resp.get_primary_ip()
 
     @property
     def cookielist(self):
-        return [parse_cookie_string(cookie) for cookie in self._resp.get_cookielist()]
+        """The session's cookie jar as it is now"""
+        return [Cookie(*cookie) for cookie in self._resp.get_cookies()]
 
     @property
     def cookies(self):
@@ -252,6 +278,18 @@ class Response:
 
     @property
     def history(self):
+        """The redirects that led to this response, oldest first: Responses when Session.request
+        followed them, Redirect records when the event loop did"""
+        if not hasattr(self, '_history'):
+            self._history = self._redirect_history()
+        return self._history
+
+    def _redirect_history(self):
+        redirects = self._resp.get_redirects()
+        if redirects:
+            urls = [url for status, url, total_time in redirects[1:]] + [self.url]
+            return [Redirect(status, url, redirect_url, total_time)
+                    for (status, url, total_time), redirect_url in zip(redirects, urls)]
         result = []
         cur = getattr(self, '_prev', None)
         while cur is not None:
@@ -263,16 +301,31 @@ class Response:
     @property
     def body(self):
         if not hasattr(self, '_body'):
-            self._body = b''.join(self._resp.get_body())
+            self._body = self._resp.get_body()
         return self._body
+
+    @property
+    def body_length(self):
+        """Bytes of body received, including when it was discarded"""
+        return self._resp.get_body_length()
+
+    @property
+    def checksum(self):
+        """Adler-32 of the body (as zlib.adler32 computes it) when the request asked for one, otherwise None"""
+        return self._resp.get_checksum()
+
+    @property
+    def body_view(self):
+        """A read only memoryview of the body, read in place without copying it into bytes. It
+        keeps the response's buffer alive for as long as it is referenced."""
+        if hasattr(self, '_body'):
+            return memoryview(self._body)
+        return self._resp.get_body_view()
     
     @property
     def encoding(self):
         if not hasattr(self, '_encoding'):
-            if 'Content-Type' in self.headers and 'charset=' in self.headers['Content-Type']:
-                self._encoding = self.headers['Content-Type'].split('charset=')[-1].split()[0]
-            else:
-                self._encoding = 'latin1'
+            self._encoding = self.headers.charset or 'latin1'
         return self._encoding
 
     @encoding.setter
@@ -282,7 +335,7 @@ class Response:
     @property
     def text(self):
         if not hasattr(self, '_text'):
-            self._text = self.body.decode(self.encoding)
+            self._text = str(self.body_view, self.encoding)
         return self._text
 
     def json(self):
@@ -292,28 +345,216 @@ class Response:
 
     @property
     def headers(self):
+        """Case insensitive mapping of the final response's headers, see _acurl.Headers"""
         if not hasattr(self, '_headers'):
-            self._headers = dict(self.headers_tuple)
+            self._headers = self._resp.get_headers()
         return self._headers
     
     @property
     def headers_tuple(self):
         if not hasattr(self, '_headers_tuple'):
-            self._headers_tuple = tuple(tuple(l.split(': ', 1)) for l in self.header.split('\r\n')[1:-2])
+            self._headers_tuple = tuple(self.headers.items())
         return self._headers_tuple
 
     @property
     def header(self):
         if not hasattr(self, '_header'):
-            self._header = b''.join(self._resp.get_header()).decode('ascii')
+            self._header = self._resp.get_header().decode('latin1')
         return self._header
 
 
+def _json_body(headers, headers_list, data, json):
+    if data is not None:
+        raise ValueError('use only one or none of data or json')
+    if not (headers and 'Content-Type' in headers) and not (headers_list and any(1 for i in headers_list if _text(i).startswith('Content-Type: '))):
+        headers_list = list(headers_list or ()) + ['Content-Type: application/json']
+    return ujson.dumps(json), headers_list
+
+
+def _text(value):
+    return value.decode('latin1') if isinstance(value, bytes) else str(value)
+
+
+def _request_record(method, url, headers, headers_list, cookies, cookie_list, auth, data):
+    """The Request for a response's request arguments, as _acurl.Session.request sent them"""
+    header_list = [_text(header) for header in headers_list or ()]
+    if headers:
+        header_list.extend('%s: %s' % (_text(name), _text(value)) for name, value in headers.items())
+    cookie_list = [parse_cookie_string(_text(cookie)) if isinstance(cookie, (str, bytes)) else cookie for cookie in cookie_list or ()]
+    if cookies:
+        cookie_list.extend(session_cookie_for_url(url, _text(name), _text(value)) for name, value in cookies.items())
+    return Request(method, url, tuple(header_list) or None, tuple(cookie_list) or None, auth, data)
+
+
+class _UploadFeeder:
+    """Pushes the chunks of an async iterator to the event loop as a request body, waiting whenever
+    it has a megabyte of them still to send. Stops when the request is over."""
+
+    def __init__(self, session, future, chunks, loop):
+        self._session = session
+        self._future = future
+        self._chunks = chunks
+        self._loop = loop
+        self._drained = None
+        self.handle = None # of the request, set before start
+        self.error = None
+
+    def _on_drained(self):
+        if self._drained is not None and not self._drained.done():
+            self._drained.set_result(None)
+
+    def start(self):
+        task = self._loop.create_task(self._run())
+        self._future.add_done_callback(lambda future: task.cancel())
+
+    async def _run(self):
+        try:
+            async for chunk in self._chunks:
+                if isinstance(chunk, str):
+                    chunk = chunk.encode()
+                self._drained = self._loop.create_future()
+                wait = self._session.upload(self.handle, chunk)
+                if wait is None:
+                    return
+                if wait:
+                    await self._drained
+            self._session.upload(self.handle, None)
+        except Exception as e:
+            # The request fails with it rather than being sent short
+            self.error = e
+            self._session.cancel(self.handle)
+
+
+def _upload_feeder(session, future, data, loop):
+    if hasattr(data, '__aiter__'):
+        return None, _UploadFeeder(session, future, data, loop)
+    if isinstance(data, io.IOBase):
+        if data.seekable():
+            # Drop what it has buffered so the fd's offset is where the file is positioned,
+            # seeking inside the buffer wouldn't
+            position = data.tell()
+            data.seek(0, os.SEEK_END)
+            data.seek(position)
+        return data.fileno(), None
+    return data, None
+
+
+class StreamResponse:
+    """A response whose body is read with async for as it arrives, from Session.stream.
+    status_code and the headers are set from the start, response is the completed Response
+    (timings, cookies and so on) once the body has been read to the end."""
+
+    def __init__(self, session, request, future, loop, start_time):
+        self._session = session
+        self._loop = loop
+        self._future = future
+        self._handle = None
+        self._start_time = start_time
+        self._chunks = deque()
+        self._ready = loop.create_future()
+        self._waiter = None
+        self._req = request
+        self.status_code = None
+        self.header = None
+        self.headers = None
+        self.response = None
+        future.add_done_callback(self._wake)
+
+    def _on_headers(self, status_code, header):
+        self.status_code = status_code
+        self.header = header.decode('latin1')
+        self.headers = _acurl.Headers(header)
+        self._wake(None)
+
+    def _on_data(self, chunk):
+        self._chunks.append(chunk)
+        self._wake(None)
+
+    def _wake(self, future):
+        for waiter in (self._ready, self._waiter):
+            if waiter is not None and not waiter.done():
+                waiter.set_result(None)
+
+    @property
+    def request(self):
+        if not isinstance(self._req, Request):
+            self._req = _request_record(*self._req)
+        return self._req
+
+    @property
+    def headers_tuple(self):
+        return tuple(self.headers.items())
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        while not self._chunks:
+            if self._future.done():
+                if self.response is None:
+                    self.response = Response(self._req, self._future.result(), self._start_time)
+                raise StopAsyncIteration
+            self._waiter = self._loop.create_future()
+            await self._waiter
+        chunk = self._chunks.popleft()
+        self._session.consumed(self._handle, len(chunk))
+        return chunk
+
+
+class _StreamContext:
+    def __init__(self, session, request, timeouts, high_water):
+        self._session = session
+        self._request = request
+        self._timeouts = timeouts
+        self._high_water = high_water
+        self._response = None
+
+    async def __aenter__(self):
+        session = self._session
+        request = self._request
+        future = session._loop.create_future()
+        self._response = response = StreamResponse(session._session, request, future, session._loop, time.time())
+        timeout, connect_timeout, stall_timeout = self._timeouts
+        method, url, headers, headers_list, cookies, cookie_list, auth, data = request
+        data, feeder = _upload_feeder(session._session, future, data, session._loop)
+        response._handle = session._session.request(future, method, url, headers=headers, headers_list=headers_list, cookies=cookies,
+                                                    cookie_list=cookie_list, auth=auth, data=data,
+                                                    timeout=timeout, connect_timeout=connect_timeout, stall_timeout=stall_timeout,
+                                                    stream=response, high_water=self._high_water, upload=feeder)
+        if feeder is not None:
+            feeder.handle = response._handle
+            feeder.start()
+        try:
+            await response._ready
+        except asyncio.CancelledError:
+            session._session.cancel(response._handle)
+            raise
+        if response.status_code is None:
+            if feeder is not None and feeder.error is not None:
+                raise feeder.error
+            future.result()
+        return response
+
+    async def __aexit__(self, exc_type, exc, tb):
+        if self._response is not None and not self._response._future.done():
+            self._session._session.cancel(self._response._handle)
+
+
 class Session:
-    def __init__(self, ae_loop, loop):
+    """discard_body, discard_headers, checksum and loop_redirects are the defaults for the session's
+    requests, see Session.request.
+
+    Sessions are cheap enough to have one per simulated user: each has its own cookie jar, while
+    the DNS cache and the connections are shared by every session on the event loop, and the TLS
+    sessions travel with the loop's pooled handles."""
+    __slots__ = '_loop _session _response_callback _body_mode _loop_redirects'.split()
+
+    def __init__(self, ae_loop, loop, discard_body=False, discard_headers=False, checksum=False, loop_redirects=False):
         self._loop = loop
         self._session = _acurl.Session(ae_loop)
         self._response_callback = None
+        self._body_mode = (discard_body, discard_headers, checksum)
+        self._loop_redirects = loop_redirects
 
     async def get(self, url, **kwargs):
         return await self.request('GET', url, **kwargs)
@@ -333,93 +574,200 @@ class Session:
     async def options(self, url, **kwargs):
         return await self.request('OPTIONS', url, **kwargs)
 
-    async def request(self, method, url, headers=None, headers_list=None, cookies=None, cookie_list=None, auth=None, data=None, json=None, allow_redirects=True, max_redirects=5):
+    async def request(self, method, url, headers=None, headers_list=None, cookies=None, cookie_list=None, auth=None, data=None, json=None, allow_redirects=True, max_redirects=5,
+                      timeout=None, connect_timeout=None, stall_timeout=None, discard_body=None, discard_headers=None, checksum=None,
+                      sink=None, preallocate=False, loop_redirects=None):
+        """data is the request body: a str (sent UTF-8 encoded) or a buffer (bytes, bytearray,
+        memoryview...) held without a copy, or streamed from the event loop in constant memory: a
+        path (pathlib.Path) or an open binary file or file descriptor, read from its current
+        position to the end, or an async iterator of bytes, sent chunked. A body from an async
+        iterator can't be sent again to follow a 307 or 308 redirect, an exception raised by the
+        iterator fails the request with it.
+
+        sink writes the body from the event loop straight to a file instead of keeping it: a path
+        (created or truncated), or a file descriptor written from its current offset in batches
+        with pwrite, preallocating the Content-Length first when preallocate is set. A writable
+        buffer (bytearray, memoryview, numpy array) is filled from the start, a body that doesn't
+        fit raises RequestError. Response.body_length is the number of bytes written. Bodies of
+        redirects aren't written.
+
+        discard_body drops the body as it arrives and only counts its length (Response.body_length),
+        for load generation where the data itself isn't looked at, discard_headers does the same
+        for the header lines. checksum computes an Adler-32 of the body (Response.checksum), kept
+        or discarded. Each defaults to the session's setting.
+
+        timeout is a deadline in seconds for the whole request including redirects,
+        connect_timeout limits connecting (and the TLS handshake) and stall_timeout how long the
+        transfer may go without receiving any data, checked by curl in whole seconds. They are
+        enforced by the event loop and raise RequestTimeout, whose phase attribute is 'deadline',
+        'connect' or 'stall'.
+
+        headers is a mapping of header names to values, headers_list a sequence of 'Name: value'
+        lines sent before them. cookies is a mapping of names to values sent as session cookies
+        for the url's host, cookie_list a sequence of Cookie. Both are added to the session's
+        cookie jar. They are handed to the event loop as they are, Response.request builds the
+        Request record only if it is looked at.
+
+        loop_redirects has the event loop follow the redirects on the same connection without
+        coming back to asyncio in between, for redirect heavy flows such as logins. The same
+        methods are used, 301, 302 and 303 become a GET, and Response.history holds a Redirect
+        record for each, the response callback only sees the final response."""
+        if json is not None:
+            data, headers_list = _json_body(headers, headers_list, data, json)
+        deadline = time.monotonic() + timeout if timeout else None
+        body_mode = self._body_mode
+        if discard_body is not None or discard_headers is not None or checksum is not None:
+            body_mode = tuple(default if option is None else option for option, default in zip((discard_body, discard_headers, checksum), body_mode))
+        sink_fd = data_fd = None
+        if isinstance(sink, (str, bytes, os.PathLike)):
+            sink = sink_fd = os.open(sink, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o666)
+        if isinstance(data, os.PathLike):
+            data = data_fd = os.open(data, os.O_RDONLY)
+        if loop_redirects is None:
+            loop_redirects = self._loop_redirects
+        try:
+            return await self._request(method, url, headers, headers_list, cookies, cookie_list, auth, data, allow_redirects, max_redirects,
+                                       (deadline, connect_timeout or 0, stall_timeout or 0), body_mode, (sink, preallocate),
+                                       allow_redirects and loop_redirects)
+        finally:
+            if sink_fd is not None:
+                os.close(sink_fd)
+            if data_fd is not None:
+                os.close(data_fd)
+
+    def stream(self, method, url, headers=None, headers_list=None, cookies=None, cookie_list=None, auth=None, data=None, json=None,
+               timeout=None, connect_timeout=None, stall_timeout=None, high_water=1 << 20):
+        """Make a request and read its body as it arrives:
+
+            async with session.stream('GET', url) as response:
+                async for chunk in response:
+                    ...
+
+        The status and headers are there on entering, chunks come in batches of whatever the event
+        loop received since the last one. When high_water bytes have been received but not read
+        the transfer is paused until half of them have been. Redirects are not followed, leaving
+        the block early cancels the request. Arguments are as for request."""
         if json is not None:
-            if data is not None:
-                raise ValueError('use only one or none of data or json')
-            data = ujson.dumps(json)
-            content_type_set = False
-            if headers and 'Content-Type' in headers:
-                content_type_set = True
-            elif headers_list:
-                content_type_set = any(1 for i in headers_list if i.startswith('Content-Type: '))
-            if not content_type_set:
-                if headers_list is None:
-                    headers_list = []
-                headers_list.append('Content-Type: application/json')
-
-        if headers:
-            if headers_list is None:
-                headers_list = []
-            headers_list.extend('%s: %s' % i for i in headers.items())
-
-        if cookies:
-            if cookie_list is None:
-                cookie_list = []
-            for k, v in cookies.items():
-                cookie_list.append(session_cookie_for_url(url, k, v))
-
-        return await self._request(method, url, tuple(headers_list) if headers_list else None, tuple(cookie_list) if cookie_list else None, auth, data, allow_redirects, max_redirects)
+            data, headers_list = _json_body(headers, headers_list, data, json)
+        return _StreamContext(self, (method, url, headers, headers_list, cookies, cookie_list, auth, data),
+                              (timeout or 0, connect_timeout or 0, stall_timeout or 0), high_water)
+
+    def get_stats(self):
+        """The session's requests in flight and the bytes they received that haven't been released
+        yet, its share of the event loop's buffered_bytes"""
+        return self._session.get_stats()
 
     def set_response_callback(self, callback):
         self._response_callback = callback
 
-    async def _request(self, method, url, header_tuple, cookie_tuple, auth, data, allow_redirects, remaining_redirects):
+    async def _request(self, method, url, headers, headers_list, cookies, cookie_list, auth, data, allow_redirects, remaining_redirects,
+                       timeouts=(None, 0, 0), body_mode=(False, False, False), sink=(None, False), loop_redirects=False):
         start_time = time.time()
-        request = Request(method, url, header_tuple, cookie_tuple, auth, data)
-        
+        deadline, connect_timeout, stall_timeout = timeouts
+        timeout = 0
+        if deadline is not None:
+            timeout = deadline - time.monotonic()
+            if timeout <= 0:
+                error = RequestTimeout('Timeout was reached')
+                error.phase = 'deadline'
+                raise error
+
         future = self._loop.create_future()
-        self._session.request(future, method, url, headers=header_tuple, cookies=tuple(c.format() for c in cookie_tuple) if cookie_tuple else None, auth=auth, data=data, dummy=False)
-        response = Response(request, await future, start_time)
-        
+        body, feeder = data, None
+        if data is not None and not isinstance(data, (bytes, str)):
+            body, feeder = _upload_feeder(self._session, future, data, self._loop)
+        handle = self._session.request(future, method, url, headers=headers, headers_list=headers_list, cookies=cookies, cookie_list=cookie_list,
+                                       auth=auth, data=body, timeout=timeout, connect_timeout=connect_timeout, stall_timeout=stall_timeout,
+                                       discard_body=body_mode[0], discard_headers=body_mode[1], checksum=body_mode[2],
+                                       sink=sink[0], preallocate=sink[1], upload=feeder,
+                                       max_redirects=remaining_redirects if loop_redirects else -1)
+        if feeder is not None:
+            feeder.handle = handle
+            feeder.start()
+        try:
+            result = await future
+        except asyncio.CancelledError:
+            if feeder is not None and feeder.error is not None:
+                raise feeder.error from None
+            # Stop the transfer now rather than letting it run to completion in the loop thread
+            self._session.cancel(handle)
+            raise
+        response = Response((method, url, headers, headers_list, cookies, cookie_list, auth, data), result, start_time)
+
         if self._response_callback:
             self._response_callback(response)
-        if allow_redirects and (300 <= response.status_code < 400) and response.redirect_url is not None:
+        if allow_redirects and not loop_redirects and (300 <= response.status_code < 400) and response.redirect_url is not None:
             if remaining_redirects == 0:
                 raise RequestError('Max Redirects')
             elif response.status_code in {301, 302, 303}:
-                redir_response = await self._request('GET', response.redirect_url, header_tuple, None, auth, None, allow_redirects, remaining_redirects - 1)
+                redir_response = await self._request('GET', response.redirect_url, headers, headers_list, None, None, auth, None, allow_redirects,
+                                                     remaining_redirects - 1, timeouts, body_mode, sink)
+            elif feeder is not None:
+                raise RequestError("can't send a body from an async iterator again to follow a redirect")
             else:
-                redir_response = await self._request(method, response.redirect_url, header_tuple, None, auth, data, allow_redirects, remaining_redirects - 1)
-            redir_response._prev = response
+                redir_response = await self._request(method, response.redirect_url, headers, headers_list, None, None, auth, data, allow_redirects,
+                                                     remaining_redirects - 1, timeouts, body_mode, sink)
+            # The hops after this one are already chained behind the final response
+            first = redir_response
+            while getattr(first, '_prev', None) is not None:
+                first = first._prev
+            first._prev = response
             return redir_response
         return response
 
-    async def _dummy_request(self, cookies):
-        future = asyncio.futures.Future(loop=self._loop)
-        self._session.request(future, 'GET', '', headers=tuple(), cookies=cookies, auth=None, data=None, dummy=True)
-        return await future
+    def export_cookies(self):
+        """The cookie jar as (http_only, domain, include_subdomains, path, is_secure, expiration,
+        name, value) tuples, read directly while the event loop goes on using it"""
+        return self._session.get_cookies()
+
+    def import_cookies(self, cookies):
+        """Add a sequence of tuples as export_cookies gives them, Cookie objects or Netscape cookie
+        lines to the cookie jar, for seeding many sessions quickly"""
+        self._session.add_cookies(cookies)
 
     async def erase_all_cookies(self):
-        await self._dummy_request(('ALL',))
+        self._session.erase_cookies(False)
 
     async def erase_session_cookies(self):
-        await self._dummy_request(('SESS',))
+        self._session.erase_cookies(True)
 
     async def get_cookie_list(self):
-        resp = await self._dummy_request(tuple())
-        return [parse_cookie_string(cookie) for cookie in resp.get_cookielist()]
+        return [Cookie(*cookie) for cookie in self._session.get_cookies()]
 
     async def add_cookie_list(self, cookie_list):
-        await self._dummy_request(tuple(c.format() for c in cookie_list))
+        self._session.add_cookies(cookie_list)
 
 class EventLoop:
-    def __init__(self, loop=None, same_thread=False):
+    def __init__(self, loop=None, same_thread=False, backend=None, edge_triggered=False, memory_budget=None):
+        """same_thread=True drives curl from the asyncio loop itself, its sockets are watched with
+        add_reader/add_writer and its timeouts scheduled with call_later, so there is no thread
+        and no handoff. Otherwise curl runs on an ae event loop in its own thread.
+
+        backend='io_uring' polls through io_uring where the kernel supports it and falls back
+        to epoll otherwise, get_backend() tells which one is in use.
+
+        edge_triggered=True registers curl's sockets edge triggered (EPOLLET, multishot polls
+        with io_uring), relying on libcurl reading until EAGAIN or asking to be run again.
+
+        memory_budget caps the header and body bytes the loop's requests hold, counted from when
+        they arrive until the response is released or its body read. Over it transfers pause and
+        new requests wait to be started until half the budget is free again, so a slow consumer
+        can't run a load generator out of memory. When it is the paused transfers' own data that
+        fills the budget one of them goes on at a time so they can complete. Responses kept
+        around while waiting for others count too: a program keeping more than half the budget
+        that way stalls until its requests time out. Time spent waiting to be started doesn't
+        count towards a request's timeouts."""
         self._loop = loop if loop is not None else asyncio.get_event_loop()
-        self._ae_loop =  _acurl.EventLoop()
         self._running = False
-        # Completed requests end up on the fd pipe, complete callback called
-        self._loop.add_reader(self._ae_loop.get_out_fd(), self._complete)
+        self._same_thread = same_thread
         if same_thread:
-            self._loop.call_later(0, self._same_thread_runner)
+            self._ae_loop = _acurl.EventLoop(asyncio_loop=self._loop, memory_budget=memory_budget or 0)
         else:
+            self._ae_loop =  _acurl.EventLoop(backend=backend, edge_triggered=edge_triggered, memory_budget=memory_budget or 0)
+            # The out fd becomes readable when requests complete, complete() resolves their futures
+            self._loop.add_reader(self._ae_loop.get_out_fd(), self._ae_loop.complete)
             self._run_in_thread()
 
-    def _same_thread_runner(self):
-        """Start event loop in normal python thread, allows use of python debugger and profiler"""
-        self._ae_loop.once()
-        self._loop.call_later(0.001, self._same_thread_runner)
-
     def _run_in_thread(self):
         if not self._running:
             self._running = True
@@ -431,20 +779,68 @@ class EventLoop:
         self._running = False
 
     def stop(self):
-        if self._running:
+        """Stop the loop thread, or with same_thread=True stop watching curl's sockets and timeout
+        on the asyncio loop. Requests still running are left unresolved."""
+        if self._running or self._same_thread:
             self._ae_loop.stop()
 
     def __del__(self):
         self.stop()
 
-    def _complete(self):
-        for error, response, future in self._ae_loop.get_completed():
-            if response is not None:
-                future.set_result(response)
-            else:
-                future.set_exception(RequestError(error))
+    def get_backend(self):
+        return self._ae_loop.get_backend()
+
+    def get_stats(self):
+        """Counters of the C event loop: requests started, in flight and cancelled, registrations (epoll_ctl calls or
+        io_uring poll submissions), polls and events returned by them, easy handle pool hits,
+        misses, live and idle handles, bytes allocated by libcurl across all loops, bytes in
+        buffer blocks (buffer_memory), received bytes not released yet (buffered_bytes),
+        requests paused or queued for the memory budget now and how many times transfers were
+        paused (budget_pauses) or requests queued (budget_waits) for it since the loop started"""
+        return self._ae_loop.get_stats()
+
+    def session(self, **kwargs):
+        return Session(self._ae_loop, self._loop, **kwargs)
+
+
 
-    def session(self):
-        return Session(self._ae_loop, self._loop)
 
+class EventLoopPool:
+    """Runs a number of event loops, each on its own thread (pinned to a cpu when pin is True)
+    with its own curl multi handle, so curl and TLS work can use more than one core.
+
+    Each session sticks to one loop so its cookies and connections stay local to it, sessions
+    are assigned to loops round robin. Completions from every loop arrive on a single queue.
+    memory_budget applies to each loop, see EventLoop."""
+    def __init__(self, size=None, loop=None, pin=True, backend=None, edge_triggered=False, memory_budget=None):
+        self._loop = loop if loop is not None else asyncio.get_event_loop()
+        if size is None:
+            size = os.cpu_count()
+        self._completions = _acurl.CompletionQueue()
+        self._ae_loops = [_acurl.EventLoop(completions=self._completions, backend=backend,
+                                          edge_triggered=edge_triggered, memory_budget=memory_budget or 0) for i in range(size)]
+        self._next_ae_loop = itertools.cycle(self._ae_loops)
+        self._loop.add_reader(self._completions.fileno(), self._completions.complete)
+        cpus = sorted(os.sched_getaffinity(0)) if pin and hasattr(os, 'sched_getaffinity') else None
+        self._threads = []
+        for i, ae_loop in enumerate(self._ae_loops):
+            cpu = cpus[i % len(cpus)] if cpus else -1
+            thread = threading.Thread(target=ae_loop.main, kwargs={'cpu': cpu}, daemon=True)
+            thread.start()
+            self._threads.append(thread)
+
+    def __len__(self):
+        return len(self._ae_loops)
+
+    def stop(self):
+        for ae_loop in self._ae_loops:
+            ae_loop.stop()
+        # So no loop thread is still running by the time the interpreter shuts down
+        for thread in self._threads:
+            thread.join()
+
+    def __del__(self):
+        self.stop()
 
+    def session(self, **kwargs):
+        return Session(next(self._next_ae_loop), self._loop, **kwargs)
@@ -0,0 +1,40 @@
+"""Measure the allocations made per request for its AcRequestData (slabs and strings that didn't
+fit inline) and its Response object (not taken from the freelist), along with the CPU cost per
+request. Once the pools are warm both should be close to 0 per request.
+
+usage: python bench_alloc.py url [number_of_requests] [concurrency]
+"""
+import asyncio
+import sys
+import time
+import acurl
+
+
+async def runner(session, url, count):
+    for i in range(count):
+        await session.request('GET', url)
+
+
+async def run(session, url, count, concurrency):
+    await asyncio.gather(*[runner(session, url, count // concurrency) for i in range(concurrency)])
+
+
+def main(url, count, concurrency):
+    loop = asyncio.get_event_loop()
+    event_loop = acurl.EventLoop(loop=loop)
+    session = event_loop.session()
+    loop.run_until_complete(run(session, url, concurrency * 10, concurrency)) # connect, warm the pools
+    before = event_loop.get_stats()
+    start_cpu, start = time.process_time(), time.perf_counter()
+    loop.run_until_complete(run(session, url, count, concurrency))
+    elapsed, cpu = time.perf_counter() - start, time.process_time() - start_cpu
+    after = event_loop.get_stats()
+    requests = after['requests'] - before['requests']
+    print('requests: {}  TPS: {:10.1f}  cpu: {:6.1f} us/request'.format(requests, requests / elapsed, cpu / requests * 1e6))
+    for name in ('request_allocations', 'response_allocations'):
+        print('{:<22} {:8.4f}/request'.format(name, (after[name] - before[name]) / requests))
+    event_loop.stop()
+
+
+if __name__ == "__main__":
+    main(sys.argv[1], int(sys.argv[2]) if len(sys.argv) > 2 else 10000, int(sys.argv[3]) if len(sys.argv) > 3 else 10)
@@ -0,0 +1,44 @@
+"""Compare requests per second of the epoll and io_uring event loop backends, level and edge
+triggered, along with poll registrations (epoll_ctl calls or io_uring poll submissions) and
+polls per request.
+
+Run it with many sessions against a local server to see the per-event kernel crossings matter.
+
+usage: python bench_backend.py url sessions duration
+"""
+import asyncio
+import sys
+import time
+import acurl
+
+
+async def runner(session, url, end_t):
+    i = 0
+    while time.time() < end_t:
+        await session.request('GET', url)
+        i += 1
+    return i
+
+
+async def run(backend, edge_triggered, url, sessions, duration):
+    event_loop = acurl.EventLoop(backend=backend, edge_triggered=edge_triggered)
+    end_t = time.time() + duration
+    results = await asyncio.gather(*[runner(event_loop.session(), url, end_t) for i in range(sessions)])
+    name = event_loop.get_backend()
+    stats = event_loop.get_stats()
+    event_loop.stop()
+    return name, sum(results), stats
+
+
+def main(url, sessions, duration):
+    loop = asyncio.get_event_loop()
+    for backend in ('epoll', 'io_uring'):
+        for edge_triggered in (False, True):
+            name, count, stats = loop.run_until_complete(run(backend, edge_triggered, url, sessions, duration))
+            print('{:<9} {:<5} TPS: {:10.1f}  registrations/request: {:5.2f}  polls/request: {:5.2f}'.format(
+                name, 'edge' if edge_triggered else 'level', count / duration,
+                stats['registrations'] / stats['requests'], stats['polls'] / stats['requests']))
+
+
+if __name__ == "__main__":
+    main(sys.argv[1], int(sys.argv[2]), int(sys.argv[3]))
@@ -0,0 +1,50 @@
+"""Measure response throughput and buffer allocations per request for 1 KB, 64 KB and 10 MB
+bodies, reading each body as bytes, in place through body_view, and discarding it with only
+its checksum computed.
+
+The url must contain %d, replaced by the body size, e.g. http://127.0.0.1:8080/bytes/%d
+
+usage: python bench_buffers.py url sessions duration
+"""
+import asyncio
+import hashlib
+import sys
+import time
+import acurl
+
+
+SIZES = (1024, 64 * 1024, 10 * 1024 * 1024)
+
+
+async def runner(session, url, end_t, read):
+    i = 0
+    while time.time() < end_t:
+        response = await session.request('GET', url)
+        if read != 'discard':
+            hashlib.md5(getattr(response, read))
+        i += 1
+    return i
+
+
+async def run(url, sessions, duration, read):
+    event_loop = acurl.EventLoop()
+    end_t = time.time() + duration
+    discard = read == 'discard'
+    results = await asyncio.gather(*[runner(event_loop.session(discard_body=discard, checksum=discard), url, end_t, read)
+                                     for i in range(sessions)])
+    stats = event_loop.get_stats()
+    event_loop.stop()
+    return sum(results), stats
+
+
+def main(url, sessions, duration):
+    loop = asyncio.get_event_loop()
+    for size in SIZES:
+        for read in ('body', 'body_view', 'discard'):
+            count, stats = loop.run_until_complete(run(url % size, sessions, duration, read))
+            print('{:>9} bytes  {:<9}  TPS: {:10.1f}  MB/s: {:8.1f}  buffer allocations/request: {:6.3f}'.format(
+                size, read, count / duration, count * size / duration / 1e6, stats['buffer_allocations'] / count))
+
+
+if __name__ == "__main__":
+    main(sys.argv[1], int(sys.argv[2]), int(sys.argv[3]))
@@ -0,0 +1,33 @@
+"""Microbenchmark of header parsing: splitting the decoded header block in Python into a dict,
+against the C Headers index, for a header heavy response. Looks up two headers per response.
+
+usage: python bench_headers.py [number_of_headers] [iterations]
+"""
+import sys
+import time
+import _acurl
+
+
+def python_headers(header):
+    return dict(tuple(l.split(': ', 1)) for l in header.decode('ascii').split('\r\n')[1:-2])
+
+
+def c_headers(header):
+    return _acurl.Headers(header)
+
+
+def main(count, iterations):
+    header = (b'HTTP/1.1 200 OK\r\nContent-Type: application/json; charset=utf-8\r\n' +
+              b''.join(b'X-Header-%d: value of header number %d\r\n' % (i, i) for i in range(count)) +
+              b'Content-Length: 1234\r\n\r\n')
+    for name, parse in (('python split', python_headers), ('c index', c_headers)):
+        start = time.perf_counter()
+        for i in range(iterations):
+            headers = parse(header)
+            headers['Content-Type']
+            headers['Content-Length']
+        print('{:<14} {:8.2f} us/response'.format(name, (time.perf_counter() - start) / iterations * 1e6))
+
+
+if __name__ == "__main__":
+    main(int(sys.argv[1]) if len(sys.argv) > 1 else 30, int(sys.argv[2]) if len(sys.argv) > 2 else 100000)
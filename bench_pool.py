@@ -0,0 +1,40 @@
+"""Measure how requests per second scale with the number of event loops in an EventLoopPool.
+
+Point it at an https url to see TLS work spread over cores.
+
+usage: python bench_pool.py url sessions duration [max_loops]
+"""
+import asyncio
+import os
+import sys
+import time
+import acurl
+
+
+async def runner(session, url, end_t):
+    i = 0
+    while time.time() < end_t:
+        await session.request('GET', url)
+        i += 1
+    return i
+
+
+async def group(size, url, sessions, duration):
+    pool = acurl.EventLoopPool(size)
+    end_t = time.time() + duration
+    results = await asyncio.gather(*[runner(pool.session(), url, end_t) for i in range(sessions)])
+    pool.stop()
+    return sum(results)
+
+
+def main(url, sessions, duration, max_loops):
+    loop = asyncio.get_event_loop()
+    base = None
+    for size in range(1, max_loops + 1):
+        tps = loop.run_until_complete(group(size, url, sessions, duration)) / duration
+        base = base or tps
+        print('loops: {:3d}  TPS: {:10.1f}  scaling: {:5.2f}x'.format(size, tps, tps / base))
+
+
+if __name__ == "__main__":
+    main(sys.argv[1], int(sys.argv[2]), int(sys.argv[3]), int(sys.argv[4]) if len(sys.argv) > 4 else os.cpu_count())
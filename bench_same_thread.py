@@ -0,0 +1,32 @@
+"""Compare the latency and CPU cost of sequential requests with curl on its own thread and curl
+driven from the asyncio loop (same_thread=True).
+
+usage: python bench_same_thread.py url [number_of_requests]
+"""
+import asyncio
+import sys
+import time
+import acurl
+
+
+async def sequential(session, url, count):
+    for i in range(count):
+        await session.request('GET', url)
+
+
+def main(url, count):
+    loop = asyncio.get_event_loop()
+    for same_thread in (False, True):
+        event_loop = acurl.EventLoop(loop=loop, same_thread=same_thread)
+        session = event_loop.session()
+        loop.run_until_complete(sequential(session, url, 10)) # connect
+        start_cpu, start = time.process_time(), time.perf_counter()
+        loop.run_until_complete(sequential(session, url, count))
+        print('{:<8} latency: {:8.1f} us/request   cpu: {:8.1f} us/request'.format(
+            event_loop.get_backend(), (time.perf_counter() - start) / count * 1e6,
+            (time.process_time() - start_cpu) / count * 1e6))
+        event_loop.stop()
+
+
+if __name__ == "__main__":
+    main(sys.argv[1], int(sys.argv[2]) if len(sys.argv) > 2 else 1000)
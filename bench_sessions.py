@@ -0,0 +1,60 @@
+"""Measure what a simulated user costs: the memory of a session before and after its first
+request, and how many new connections (TLS handshakes for https) its requests need when every
+session on the loop shares the DNS cache and connections. The memory is the process's resident
+size and the bytes libcurl has allocated (EventLoop.get_stats), divided by the number of sessions.
+
+Each session makes its first request on its own, then the rest one after the other with all
+sessions at once. Point it at an https url to count handshakes, a server that closes the
+connection after each response shows how many of them are resumed, as the handshake time drops.
+
+usage: python bench_sessions.py url [number_of_sessions] [requests_per_session]
+"""
+import asyncio
+import sys
+import acurl
+
+
+def rss():
+    with open('/proc/self/statm') as statm:
+        return int(statm.read().split()[1]) * 4096
+
+
+def usage(event_loop):
+    return rss(), event_loop.get_stats()['curl_memory']
+
+
+def report(name, before, after, count):
+    print('{:<22} {:8.0f} bytes/session resident, {:8.0f} bytes/session in libcurl'.format(
+        name, (after[0] - before[0]) / count, (after[1] - before[1]) / count))
+
+
+async def user(session, url, count):
+    connects = []
+    for i in range(count):
+        response = await session.get(url)
+        connects.append((response.num_connects, response.appconnect_time - response.connect_time))
+    return connects
+
+
+async def run(url, sessions, requests):
+    event_loop = acurl.EventLoop()
+    await event_loop.session().get(url) # start the loop, DNS and connection cache
+    start = usage(event_loop)
+    users = [event_loop.session() for i in range(sessions)]
+    idle = usage(event_loop)
+    report('sessions', start, idle, sessions)
+    # One at a time, so the loop's handles and connections stay as they were
+    first = [await user(session, url, 1) for session in users]
+    report('after a request each', start, usage(event_loop), sessions)
+    rest = await asyncio.gather(*[user(session, url, requests - 1) for session in users])
+    connects = [connect for connects in first + rest for connect in connects]
+    handshakes = [handshake for new, handshake in connects if new > 0]
+    print('{} requests, {:.3f} new connections per request'.format(len(connects), len(handshakes) / len(connects)))
+    if handshakes and url.startswith('https'):
+        print('TLS handshake: {:.3f} ms on average'.format(sum(handshakes) / len(handshakes) * 1e3))
+    event_loop.stop()
+
+
+if __name__ == "__main__":
+    asyncio.get_event_loop().run_until_complete(
+        run(sys.argv[1], int(sys.argv[2]) if len(sys.argv) > 2 else 1000, int(sys.argv[3]) if len(sys.argv) > 3 else 10))
@@ -0,0 +1,75 @@
+"""Compare the cost of handing requests to the event loop thread.
+
+ring: _acurl.Session.request() pushing onto the lock-free submission ring, one doorbell write
+      per batch.
+pipe: the same calls plus the write() per request and read() per wakeup the previous pipe based
+      submission paid, reproduced with an 8 byte payload (a pointer) and a reader thread.
+
+Requests file:///dev/null by default so no network traffic is involved, end to end includes
+running each transfer in the loop thread.
+
+usage: python bench_submit.py [number_of_requests] [url]
+"""
+import asyncio
+import os
+import sys
+import threading
+import time
+import _acurl
+
+
+BATCH = 4096 # stay below the ring size so submission never waits for the loop thread
+
+async def submit(count, url, use_pipe):
+    loop = asyncio.get_event_loop()
+    ae_loop = _acurl.EventLoop()
+    thread = threading.Thread(target=ae_loop.main, daemon=True)
+    thread.start()
+    session = _acurl.Session(ae_loop)
+    loop.add_reader(ae_loop.get_out_fd(), ae_loop.complete)
+    if use_pipe:
+        read_fd, write_fd = os.pipe()
+        reader = threading.Thread(target=drain_pipe, args=(read_fd, count), daemon=True)
+        reader.start()
+    payload = b'\0' * 8
+    submit = 0
+    start = time.perf_counter()
+    for i in range(0, count, BATCH):
+        futures = [loop.create_future() for i in range(min(BATCH, count - i))]
+        batch_start = time.perf_counter()
+        for future in futures:
+            session.request(future, 'GET', url, headers=None, auth=None, cookies=None, data=None)
+            if use_pipe:
+                os.write(write_fd, payload)
+        submit += time.perf_counter() - batch_start
+        await asyncio.gather(*futures)
+    total = time.perf_counter() - start
+    loop.remove_reader(ae_loop.get_out_fd())
+    ae_loop.stop()
+    thread.join()
+    if use_pipe:
+        reader.join()
+        os.close(read_fd)
+        os.close(write_fd)
+    return submit, total
+
+
+def drain_pipe(read_fd, count):
+    while count:
+        os.read(read_fd, 8)
+        count -= 1
+
+
+def report(name, count, submit, total):
+    print('{:<6} submit: {:8.0f} ns/request   end to end: {:8.0f} ns/request'.format(
+        name, submit / count * 1e9, total / count * 1e9))
+
+
+def main(count, url):
+    loop = asyncio.get_event_loop()
+    report('ring', count, *loop.run_until_complete(submit(count, url, False)))
+    report('pipe', count, *loop.run_until_complete(submit(count, url, True)))
+
+
+if __name__ == "__main__":
+    main(int(sys.argv[1]) if len(sys.argv) > 1 else 100000, sys.argv[2] if len(sys.argv) > 2 else 'file:///dev/null')
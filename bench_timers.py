@@ -0,0 +1,73 @@
+"""Microbenchmark of the ae timer heap with a large number of armed timers.
+
+Drives the ae functions compiled into _acurl through ctypes and reports the cost of arming
+timers, of an event loop iteration while they are armed (finding the nearest timer), of
+deleting them, and of firing them.
+
+usage: python bench_timers.py [number_of_timers]
+"""
+import ctypes
+import random
+import sys
+import time
+import _acurl
+
+
+AE_TIME_EVENTS = 2
+AE_DONT_WAIT = 4
+AE_NOMORE = -1
+
+ae = ctypes.CDLL(_acurl.__file__)
+ae.aeCreateEventLoop.restype = ctypes.c_void_p
+ae.aeCreateEventLoop.argtypes = [ctypes.c_int]
+ae.aeDeleteEventLoop.argtypes = [ctypes.c_void_p]
+TimeProc = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_longlong, ctypes.c_void_p)
+ae.aeCreateTimeEventNs.restype = ctypes.c_longlong
+ae.aeCreateTimeEventNs.argtypes = [ctypes.c_void_p, ctypes.c_longlong, TimeProc, ctypes.c_void_p, ctypes.c_void_p]
+ae.aeDeleteTimeEvent.argtypes = [ctypes.c_void_p, ctypes.c_longlong]
+ae.aeProcessEvents.argtypes = [ctypes.c_void_p, ctypes.c_int]
+
+
+def report(name, count, elapsed):
+    print('{:<28} {:10.0f} ns/op'.format(name, elapsed / count * 1e9))
+
+
+def main(count):
+    fired = [0]
+    @TimeProc
+    def on_timer(event_loop, id, client_data):
+        fired[0] += 1
+        return AE_NOMORE
+
+    event_loop = ae.aeCreateEventLoop(200)
+    delays = [random.randint(1, 60000) * 1000000 for i in range(count)]
+
+    start = time.perf_counter()
+    ids = [ae.aeCreateTimeEventNs(event_loop, delay, on_timer, None, None) for delay in delays]
+    report('arm ({} timers)'.format(count), count, time.perf_counter() - start)
+
+    iterations = 10000
+    start = time.perf_counter()
+    for i in range(iterations):
+        ae.aeProcessEvents(event_loop, AE_TIME_EVENTS | AE_DONT_WAIT)
+    report('loop iteration (armed)', iterations, time.perf_counter() - start)
+
+    random.shuffle(ids)
+    start = time.perf_counter()
+    for id in ids:
+        ae.aeDeleteTimeEvent(event_loop, id)
+    report('delete', count, time.perf_counter() - start)
+
+    for i in range(count):
+        ae.aeCreateTimeEventNs(event_loop, random.randint(0, 1000), on_timer, None, None)
+    time.sleep(0.001)
+    start = time.perf_counter()
+    while fired[0] < count:
+        ae.aeProcessEvents(event_loop, AE_TIME_EVENTS | AE_DONT_WAIT)
+    report('fire (includes callback)', count, time.perf_counter() - start)
+
+    ae.aeDeleteEventLoop(event_loop)
+
+
+if __name__ == "__main__":
+    main(int(sys.argv[1]) if len(sys.argv) > 1 else 100000)
@@ -1,11 +1,19 @@
+#define _GNU_SOURCE 1 /* for pthread_setaffinity_np */
 #include "ae/ae.h"
 #include <curl/multi.h>
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include "structmember.h"
 
 #define NO_ACTIVE_TIMER_ID -1
@@ -68,301 +76,1566 @@ static inline int getmem(void) {
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
 
-typedef struct {
-    PyObject_HEAD
-    aeEventLoop *event_loop;
-    PyThreadState* thread_state;
-    CURLM *multi;
-    long long timer_id;
-    bool stop;
-    int req_in_read;
-    int req_in_write;
-    int req_out_read;
-    int req_out_write;
-    int stop_read;
-    int stop_write;
-    int curl_easy_cleanup_read;
-    int curl_easy_cleanup_write;
-} EventLoop;
-
-
-typedef struct {
-    PyObject_HEAD
-    EventLoop *loop;
-    CURLSH *shared;
-} Session;
-
-/* Node in a linked list structure. Used for piecing together sections of resposnes e.g. headers and body. 
- * Possible optimisation to have a memory pool for buffer nodes so they aren't being malloc'ed all the time */
+#define CACHE_LINE_SIZE 64
 
-struct BufferNode {
-    int len;
-    char *buffer;
-    struct BufferNode *next;
-};
+/* Bounded multi-producer single-consumer ring of pointers (Dmitry Vyukov's bounded queue
+ * with the consumer side simplified). Producers are Python threads submitting requests, the
+ * consumer is the event loop thread. Each cell carries a sequence number so a producer can
+ * claim a slot with a single CAS and publish it without locking. */
 
+#define REQUEST_RING_SIZE 16384 /* must be a power of two */
 
 typedef struct {
-    char* method;
-    char* url;
-    char* auth;
-    PyObject* cookies;
-    int cookies_len;
-    char** cookies_str;
-    PyObject* future;
-    struct curl_slist* headers;
-    int req_data_len;
-    char* req_data_buf;
-    Session* session;
-    CURL *curl;
-    CURLcode result;
-    struct BufferNode *header_buffer_head;
-    struct BufferNode *header_buffer_tail;
-    struct BufferNode *body_buffer_head;
-    struct BufferNode *body_buffer_tail;
-    int dummy;
-} AcRequestData;
-
+    size_t sequence;
+    void *data;
+} RingCell;
 
 typedef struct {
-    PyObject_HEAD
-    struct BufferNode *header_buffer;
-    struct BufferNode *body_buffer;
-    Session *session;
-    CURL *curl;
-} Response;
+    RingCell *cells;
+    size_t mask;
+    char pad0[CACHE_LINE_SIZE];
+    size_t tail; /* next slot to claim, shared by producers */
+    char pad1[CACHE_LINE_SIZE];
+    size_t head; /* next slot to read, consumer only */
+} Ring;
 
 
-void free_buffer_nodes(struct BufferNode *start) {
-    ENTER();
-    struct BufferNode *node = start;
-    while(node != NULL)
-    {
-        struct BufferNode *next = node->next;
-        free(node->buffer);
-        free(node);
-        node = next;
-    };
-    EXIT();
+void ring_init(Ring *ring, size_t size)
+{
+    ring->cells = (RingCell *)malloc(sizeof(RingCell) * size);
+    for(size_t i = 0; i < size; i++) {
+        ring->cells[i].sequence = i;
+        ring->cells[i].data = NULL;
+    }
+    ring->mask = size - 1;
+    ring->tail = 0;
+    ring->head = 0;
 }
 
-/* Python deallocator for Response Object. For GC */
 
-static void Response_dealloc(Response *self)
+void ring_free(Ring *ring)
 {
-    ENTER();
-    DEBUG_PRINT("response=%p", self);
-    free_buffer_nodes(self->header_buffer);
-    free_buffer_nodes(self->body_buffer);
-    write(self->session->loop->curl_easy_cleanup_write, &self->curl, sizeof(CURL *));
-    Py_XDECREF(self->session);
-    Py_TYPE(self)->tp_free((PyObject*)self);
-    EXIT();
+    free(ring->cells);
+    ring->cells = NULL;
 }
 
+/* Returns false if the ring is full */
 
-PyObject * get_buffer_as_pylist(struct BufferNode *start) 
+static inline bool ring_push(Ring *ring, void *data)
 {
-    ENTER();
-    int i = 0, len = 0;
-    PyObject* list;
-    struct BufferNode *node = start;
-    while(node != NULL)
-    {
-        len++;
-        node = node->next;
-    };
-    list = PyList_New(len);
-    node = start;;
-    while(node != NULL)
-    {
-        PyList_SET_ITEM(list, i++, PyBytes_FromStringAndSize(node->buffer, node->len));
-        node = node->next;
-    };
-    DEBUG_PRINT("list=%p", list);
-    EXIT();
-    return list;
+    RingCell *cell;
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    while(true) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if(diff < 0) {
+            return false;
+        }
+        else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->data = data;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
 }
 
+/* Returns NULL if the ring is empty, must only be called from the consumer thread */
 
-static PyObject *
-Response_get_header(Response *self, PyObject *args)
-{   
-    ENTER();
-    DEBUG_PRINT("");
-    PyObject *rtn = get_buffer_as_pylist(self->header_buffer);
-    EXIT();
-    return rtn;
+static inline void *ring_pop(Ring *ring)
+{
+    size_t pos = ring->head;
+    RingCell *cell = &ring->cells[pos & ring->mask];
+    size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    if((intptr_t)seq - (intptr_t)(pos + 1) < 0) {
+        return NULL;
+    }
+    void *data = cell->data;
+    __atomic_store_n(&cell->sequence, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    ring->head = pos + 1;
+    return data;
 }
 
+/* A doorbell wakes the thread on the other side of a queue. It is an eventfd on Linux and a
+ * pipe elsewhere. pending counts items pushed since the consumer last cleared the doorbell,
+ * only the producer that moves it from zero writes to the fd so a busy consumer isn't woken
+ * once per item. */
 
-static PyObject *
-Response_get_body(Response *self, PyObject *args)
-{
-    ENTER();
-    DEBUG_PRINT("");
-    PyObject *rtn = get_buffer_as_pylist(self->body_buffer);
-    EXIT();
-    return rtn;
-}
+typedef struct {
+    int read_fd;
+    int write_fd;
+    char pad[CACHE_LINE_SIZE];
+    unsigned long pending;
+} Doorbell;
 
 
-PyObject *resp_get_info_long(Response *self, CURLINFO info)
-{
-    ENTER();
-    long value;
-    curl_easy_getinfo(self->curl, info, &value);
-    PyObject *rtn = PyLong_FromLong(value);
-    EXIT();
-    return rtn;
-}
+void set_none_blocking(int fd);
 
-PyObject *resp_get_info_double(Response *self, CURLINFO info)
+
+void doorbell_init(Doorbell *doorbell)
 {
-    ENTER();
-    double value;
-    curl_easy_getinfo(self->curl, info, &value);
-    PyObject *rtn = PyFloat_FromDouble(value);
-    EXIT();
-    return rtn;
+#ifdef __linux__
+    doorbell->read_fd = doorbell->write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    int fds[2];
+    pipe(fds);
+    set_none_blocking(fds[0]);
+    set_none_blocking(fds[1]);
+    doorbell->read_fd = fds[0];
+    doorbell->write_fd = fds[1];
+#endif
+    doorbell->pending = 0;
 }
 
-PyObject *resp_get_info_unicode(Response *self, CURLINFO info)
+
+void doorbell_free(Doorbell *doorbell)
 {
-    ENTER();
-    char *value = NULL;
-    curl_easy_getinfo(self->curl, info, &value);
-    PyObject *rtn;
-    if(value != NULL) {
-        rtn = PyUnicode_FromString(value);
+    close(doorbell->read_fd);
+    if(doorbell->write_fd != doorbell->read_fd) {
+        close(doorbell->write_fd);
     }
-    else {
-        Py_INCREF(Py_None);
-        rtn = Py_None;
-    }
-    EXIT();
-    return rtn;
 }
 
-static PyObject *Response_get_effective_url(Response *self, PyObject *args)
-{
-    ENTER();
-    PyObject *rtn = resp_get_info_unicode(self, CURLINFO_EFFECTIVE_URL);
-    EXIT();
-    return rtn;
-}
+/* Call after pushing to the queue. Returns true if the fd was written to */
 
-static PyObject *Response_get_response_code(Response *self, PyObject *args)
+static inline bool doorbell_ring(Doorbell *doorbell)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_long(self, CURLINFO_RESPONSE_CODE);
-    EXIT();
-    return rtn;
+    if(__atomic_fetch_add(&doorbell->pending, 1, __ATOMIC_SEQ_CST) != 0) {
+        return false;
+    }
+#ifdef __linux__
+    uint64_t one = 1;
+    write(doorbell->write_fd, &one, sizeof(one));
+#else
+    write(doorbell->write_fd, "", 1);
+#endif
+    return true;
 }
 
-static PyObject *Response_get_total_time(Response *self, PyObject *args)
+/* Call before draining the queue so that anything pushed during the drain rings again.
+ * Returns the number of items pushed since the last clear. */
+
+static inline unsigned long doorbell_clear(Doorbell *doorbell)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_double(self, CURLINFO_TOTAL_TIME);
-    EXIT();
-    return rtn;
+#ifdef __linux__
+    uint64_t value;
+    read(doorbell->read_fd, &value, sizeof(value));
+#else
+    char buffer[64];
+    while(read(doorbell->read_fd, buffer, sizeof(buffer)) > 0);
+#endif
+    return __atomic_exchange_n(&doorbell->pending, 0, __ATOMIC_SEQ_CST);
 }
 
-static PyObject *Response_get_namelookup_time(Response *self, PyObject *args)
+/* Intrusive lock-free stack. Any number of threads can push, a single consumer takes the whole
+ * stack at once with an exchange, which also sidesteps the ABA problem of popping one node at
+ * a time. Embed a StackNode in the struct being queued and use container_of to get back to it. */
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+typedef struct StackNode {
+    struct StackNode *next;
+} StackNode;
+
+typedef struct {
+    StackNode *head;
+} Stack;
+
+
+static inline void stack_push(Stack *stack, StackNode *node)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_double(self, CURLINFO_NAMELOOKUP_TIME);
-    EXIT();
-    return rtn;
+    StackNode *head = __atomic_load_n(&stack->head, __ATOMIC_RELAXED);
+    do {
+        node->next = head;
+    } while(!__atomic_compare_exchange_n(&stack->head, &head, node, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-static PyObject *Response_get_connect_time(Response *self, PyObject *args)
+/* Take every node, oldest first */
+
+static inline StackNode *stack_pop_all(Stack *stack)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_double(self, CURLINFO_CONNECT_TIME);
-    EXIT();
-    return rtn;
+    StackNode *node = __atomic_exchange_n(&stack->head, NULL, __ATOMIC_ACQUIRE);
+    StackNode *reversed = NULL;
+    while(node != NULL) {
+        StackNode *next = node->next;
+        node->next = reversed;
+        reversed = node;
+        node = next;
+    }
+    return reversed;
 }
 
-static PyObject *Response_get_appconnect_time(Response *self, PyObject *args)
+/* Completed requests from one or more event loops, drained by the asyncio loop */
+
+typedef struct {
+    PyObject_HEAD
+    Stack completed;
+    Stack streamed; /* StreamBatches */
+    Doorbell doorbell;
+} CompletionQueue;
+
+/* Easy handles are recycled by their event loop instead of being created and destroyed per
+ * request. Whichever thread is done with a handle pushes it onto the loop's returned stack, the
+ * loop thread takes the whole stack back when its own free list runs dry. Options that are the
+ * same for every request are set once, when the handle is created. */
+
+#define EASY_HANDLE_POOL_MAX 1024 /* idle handles kept per loop */
+
+typedef struct {
+    StackNode node; /* in the returned stack or the free list */
+    CURL *curl;
+    CURLSH *shared; /* share the handle is attached to */
+} EasyHandle;
+
+/* A session's CURLSH and the locks curl takes on it, one per kind of data since curl may hold two
+ * at once. They are only contended between the loop thread and the Python side reading or
+ * changing the cookie jar, each holding them for one curl call, so they spin. When the session
+ * is deallocated the loop thread cleans it up once no idle handle uses it */
+
+typedef struct {
+    StackNode node; /* in the loop's retired_shares stack */
+    CURLSH *shared;
+    int locks[CURL_LOCK_DATA_LAST];
+} Share;
+
+static void share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_double(self, CURLINFO_APPCONNECT_TIME);
-    EXIT();
-    return rtn;
+    int *lock = &((Share *)userptr)->locks[data];
+    while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            sched_yield();
+        }
+    }
 }
 
-static PyObject *Response_get_pretransfer_time(Response *self, PyObject *args)
+static void share_unlock(CURL *curl, curl_lock_data data, void *userptr)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_double(self, CURLINFO_PRETRANSFER_TIME);
-    EXIT();
-    return rtn;
+    __atomic_store_n(&((Share *)userptr)->locks[data], 0, __ATOMIC_RELEASE);
 }
 
-static PyObject *Response_get_starttransfer_time(Response *self, PyObject *args)
+/* Response headers and bodies are each kept in one contiguous buffer that grows by doubling,
+ * instead of a malloc'ed node per chunk curl hands over. Blocks come from per-loop free lists of
+ * power of two size classes, BUFFER_MIN_SIZE up to BUFFER_MIN_SIZE << (BUFFER_CLASSES - 1),
+ * bigger ones are malloc'ed and realloc'ed on their own. Like easy handles, whichever thread is
+ * done with a block pushes it onto the loop's returned stack and the loop thread sorts them back
+ * into its free lists. */
+
+#define BUFFER_MIN_SHIFT 10 /* 1 KB */
+#define BUFFER_MIN_SIZE ((size_t)1 << BUFFER_MIN_SHIFT)
+#define BUFFER_CLASSES 8 /* 1 KB to 128 KB */
+#define BUFFER_POOL_MAX 64 /* idle blocks kept per size class */
+#define BUFFER_PRESIZE_MAX ((curl_off_t)64 << 20) /* trust Content-Length up to 64 MB */
+
+typedef struct {
+    StackNode node; /* in the returned stack or a free list */
+    size_t size;
+    int size_class; /* -1 when outside the pool */
+    char data[];
+} BufferBlock;
+
+typedef struct {
+    BufferBlock *block; /* NULL while empty */
+    size_t len;
+} Buffer;
+
+
+typedef struct {
+    PyObject_HEAD
+    aeEventLoop *event_loop;
+    PyThreadState* thread_state;
+    CURLM *multi;
+    long long timer_id;
+    bool stop;
+    bool running;
+    Ring req_in;
+    Doorbell req_in_doorbell;
+    CompletionQueue *completions;
+    int stop_read;
+    int stop_write;
+    StackNode *free_handles; /* EasyHandles, loop thread only */
+    int free_handles_len;
+    Stack retired_shares;
+    Stack cancelled_requests; /* AcRequestData, pushed by Session.cancel */
+    long long requests_in_flight;
+    long long requests_cancelled;
+    long long handle_pool_hits;
+    long long handle_pool_misses;
+    long long handles_live;
+    Stack returned_buffers; /* BufferBlocks, pushed from any thread */
+    StackNode *free_buffers[BUFFER_CLASSES]; /* BufferBlocks, loop thread only */
+    int free_buffers_len[BUFFER_CLASSES];
+    long long buffer_allocations;
+    struct AcRequestData *dirty_streams; /* streamed requests curl wrote to since the last flush */
+    Stack resumed_streams; /* AcRequestData, pushed by Session.consumed */
+    int socket_edge; /* AE_EDGE when curl sockets are registered edge triggered */
+    long long requests_started;
+    PyObject *asyncio_loop; /* when set curl is driven from this asyncio loop instead of ae */
+    PyObject *asyncio_timer; /* handle of the pending curl timeout on asyncio_loop */
+    unsigned char *asyncio_masks; /* the events watched on asyncio_loop, by socket */
+    int asyncio_masks_len;
+    bool asyncio_submitting; /* inside submit_request, a timeout of 0 is run before returning */
+    bool asyncio_timeout_now;
+    long long buffer_memory; /* bytes in BufferBlocks, in use or pooled, loop thread only */
+    long long buffered_bytes; /* header and body bytes received and not released yet */
+    long long handed_bytes; /* the part of buffered_bytes completed or streamed to Python */
+    long long memory_budget; /* 0 for none */
+    int budget_blocked; /* requests are paused or queued until buffered_bytes is back down */
+    struct AcRequestData *budget_paused; /* loop thread only */
+    long long budget_paused_len;
+    struct AcRequestData *budget_queued; /* oldest first, loop thread only */
+    struct AcRequestData *budget_queued_tail;
+    long long budget_queued_len;
+    long long budget_pauses; /* transfers paused and requests queued for the budget, ever */
+    long long budget_waits;
+} EventLoop;
+
+
+typedef struct {
+    PyObject_HEAD
+    EventLoop *loop;
+    Share *share; /* the cookie jar, NULL until the session first needs it */
+    struct AcRequestData *in_flight; /* requests whose future hasn't been resolved yet */
+    long long in_flight_len;
+    long long buffered_bytes; /* the session's share of its loop's buffered_bytes */
+} Session;
+
+/* A session's share only holds its cookie jar. The DNS cache and the connections are the loop's
+ * multi handle's, shared by every session on the loop, and TLS sessions are cached by the pooled
+ * easy handles that go from one session to the next, so a simulated user resumes and reuses what
+ * the others set up. Created on first use, a session that hasn't made a request yet costs only
+ * its object. GIL */
+
+static Share *session_share(Session *self)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_double(self, CURLINFO_STARTTRANSFER_TIME);
-    EXIT();
-    return rtn;
+    if(self->share == NULL) {
+        Share *share = (Share *)calloc(1, sizeof(Share));
+        if(share == NULL || (share->shared = curl_share_init()) == NULL) {
+            free(share);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        self->share = share;
+        curl_share_setopt(self->share->shared, CURLSHOPT_LOCKFUNC, share_lock);
+        curl_share_setopt(self->share->shared, CURLSHOPT_UNLOCKFUNC, share_unlock);
+        curl_share_setopt(self->share->shared, CURLSHOPT_USERDATA, self->share);
+        curl_share_setopt(self->share->shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+    }
+    return self->share;
 }
 
-static PyObject *Response_get_size_upload(Response *self, PyObject *args)
+/* The Python side's way into a session's cookie jar: an easy handle attached to the share it is
+ * working on, curl takes the share's cookie lock around each call. GIL */
+
+static CURL *jar_handle;
+static Share *jar_share;
+
+static CURL *jar_attach(Share *share)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_double(self, CURLINFO_SIZE_UPLOAD);
-    EXIT();
-    return rtn;
+    if(share == NULL) {
+        return NULL;
+    }
+    if(jar_handle == NULL && (jar_handle = curl_easy_init()) == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if(jar_share != share) {
+        curl_easy_setopt(jar_handle, CURLOPT_SHARE, share->shared);
+        jar_share = share;
+    }
+    return jar_handle;
 }
 
-static PyObject *Response_get_size_download(Response *self, PyObject *args)
+/* Before the share is retired, curl won't clean up a share a handle is still attached to */
+
+static void jar_detach(Share *share)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_double(self, CURLINFO_SIZE_DOWNLOAD);
-    EXIT();
-    return rtn;
+    if(jar_share == share) {
+        curl_easy_setopt(jar_handle, CURLOPT_SHARE, NULL);
+        jar_share = NULL;
+    }
 }
 
-static PyObject *Response_get_primary_ip(Response *self, PyObject *args)
+/* One of curl's Netscape cookie lines as the tuple acurl.Cookie takes: (http_only, domain,
+ * include_subdomains, path, is_secure, expiration, name, value) */
+
+static PyObject *cookie_line_tuple(const char *line)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_unicode(self, CURLINFO_PRIMARY_IP);
-    EXIT();
-    return rtn;
+    int http_only = strncmp(line, "#HttpOnly_", 10) == 0;
+    const char *fields[7] = {NULL, NULL, NULL, NULL, NULL, NULL, ""};
+    Py_ssize_t lens[7] = {0, 0, 0, 0, 0, 0, 0};
+    int n = 0;
+    line += http_only ? 10 : 0;
+    for(;;) {
+        /* The value is whatever is left, tabs and all */
+        const char *tab = n < 6 ? strchr(line, '\t') : NULL;
+        fields[n] = line;
+        lens[n++] = tab != NULL ? tab - line : (Py_ssize_t)strlen(line);
+        if(tab == NULL) {
+            break;
+        }
+        line = tab + 1;
+    }
+    if(n < 6) {
+        PyErr_Format(PyExc_ValueError, "malformed cookie line: %s", fields[0]);
+        return NULL;
+    }
+    return Py_BuildValue("(Ns#Ns#NLs#s#)", PyBool_FromLong(http_only), fields[0], lens[0],
+                         PyBool_FromLong(lens[1] == 4 && memcmp(fields[1], "TRUE", 4) == 0), fields[2], lens[2],
+                         PyBool_FromLong(lens[3] == 4 && memcmp(fields[3], "TRUE", 4) == 0), strtoll(fields[4], NULL, 10),
+                         fields[5], lens[5], fields[6], lens[6]);
 }
 
-static PyObject *Response_get_cookielist(Response *self, PyObject *args)
+/* The cookies in a session's jar, as curl's lines or as tuples. GIL */
+
+static PyObject *jar_export(Share *share, bool tuples)
 {
-    ENTER();
     struct curl_slist *start = NULL;
-    struct curl_slist *node = NULL;
-    int len = 0; int i = 0;
-    PyObject *list = NULL;
-    curl_easy_getinfo(self->curl, CURLINFO_COOKIELIST, &start);
-    node = start;
-    while(node != NULL) {
+    Py_ssize_t len = 0, i = 0;
+    CURL *curl = jar_attach(share);
+    if(curl == NULL) {
+        return NULL;
+    }
+    curl_easy_getinfo(curl, CURLINFO_COOKIELIST, &start);
+    for(struct curl_slist *node = start; node != NULL; node = node->next) {
         len++;
-        node = node->next;
     }
-    list = PyList_New(len);
-    node = start;
-    while(node != NULL)
-    {
-        PyList_SET_ITEM(list, i++, PyUnicode_FromString(node->data));
-        node = node->next;
-    };
+    PyObject *list = PyList_New(len);
+    for(struct curl_slist *node = start; list != NULL && node != NULL; node = node->next) {
+        PyObject *cookie = tuples ? cookie_line_tuple(node->data) : PyUnicode_FromString(node->data);
+        if(cookie == NULL) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i++, cookie);
+    }
     curl_slist_free_all(start);
-    EXIT();
     return list;
 }
 
-static PyObject *Response_get_redirect_url(Response *self, PyObject *args)
+/* Move the blocks returned since last time onto their free lists, freeing any beyond
+ * BUFFER_POOL_MAX and those outside the pool. Loop thread only */
+
+static void buffer_block_collect(EventLoop *loop)
 {
-    ENTER();
-    PyObject *rtn = resp_get_info_unicode(self, CURLINFO_REDIRECT_URL);
-    EXIT();
-    return rtn;
+    StackNode *node = __atomic_exchange_n(&loop->returned_buffers.head, NULL, __ATOMIC_ACQUIRE);
+    while(node != NULL) {
+        StackNode *next = node->next;
+        BufferBlock *block = container_of(node, BufferBlock, node);
+        if(block->size_class >= 0 && loop->free_buffers_len[block->size_class] < BUFFER_POOL_MAX) {
+            node->next = loop->free_buffers[block->size_class];
+            loop->free_buffers[block->size_class] = node;
+            loop->free_buffers_len[block->size_class]++;
+        }
+        else {
+            loop->buffer_memory -= block->size;
+            free(block);
+        }
+        node = next;
+    }
+}
+
+/* Take a block of at least size bytes from the pool, or allocate one. Loop thread only */
+
+static BufferBlock *buffer_block_get(EventLoop *loop, size_t size)
+{
+    int size_class = 0;
+    while(size_class < BUFFER_CLASSES && (BUFFER_MIN_SIZE << size_class) < size) {
+        size_class++;
+    }
+    BufferBlock *block;
+    if(size_class == BUFFER_CLASSES) {
+        block = (BufferBlock *)malloc(sizeof(BufferBlock) + size);
+        size_class = -1;
+    }
+    else {
+        if(loop->free_buffers[size_class] == NULL) {
+            buffer_block_collect(loop);
+        }
+        if(loop->free_buffers[size_class] != NULL) {
+            block = container_of(loop->free_buffers[size_class], BufferBlock, node);
+            loop->free_buffers[size_class] = block->node.next;
+            loop->free_buffers_len[size_class]--;
+            return block;
+        }
+        size = BUFFER_MIN_SIZE << size_class;
+        block = (BufferBlock *)malloc(sizeof(BufferBlock) + size);
+    }
+    if(unlikely(block == NULL)) {
+        return NULL;
+    }
+    block->size = size;
+    block->size_class = size_class;
+    loop->buffer_allocations++;
+    loop->buffer_memory += size;
+    return block;
+}
+
+/* Hand a buffer's block back to its loop, from any thread */
+
+static inline void buffer_release(EventLoop *loop, Buffer *buffer)
+{
+    if(buffer->block != NULL) {
+        stack_push(&loop->returned_buffers, &buffer->block->node);
+        buffer->block = NULL;
+        buffer->len = 0;
+    }
+}
+
+/* Make room for size bytes in total, at least doubling. Loop thread only */
+
+static bool buffer_reserve(EventLoop *loop, Buffer *buffer, size_t size)
+{
+    BufferBlock *block = buffer->block;
+    if(block != NULL && size <= block->size) {
+        return true;
+    }
+    if(block != NULL && size < block->size * 2) {
+        size = block->size * 2;
+    }
+    if(block != NULL && block->size_class < 0) {
+        block = (BufferBlock *)realloc(block, sizeof(BufferBlock) + size);
+        if(unlikely(block == NULL)) {
+            return false;
+        }
+        loop->buffer_memory += size - block->size;
+        block->size = size;
+        loop->buffer_allocations++;
+        buffer->block = block;
+        return true;
+    }
+    BufferBlock *grown = buffer_block_get(loop, size);
+    if(unlikely(grown == NULL)) {
+        return false;
+    }
+    if(block != NULL) {
+        memcpy(grown->data, block->data, buffer->len);
+        stack_push(&loop->returned_buffers, &block->node);
+    }
+    buffer->block = grown;
+    return true;
+}
+
+static inline bool buffer_append(EventLoop *loop, Buffer *buffer, const char *data, size_t len)
+{
+    if(!buffer_reserve(loop, buffer, buffer->len + len)) {
+        return false;
+    }
+    memcpy(buffer->block->data + buffer->len, data, len);
+    buffer->len += len;
+    return true;
+}
+
+/* Received bytes are counted in buffered_bytes from when curl hands them over until the buffer
+ * holding them is released, whether that is still in curl's hands or waiting for Python, and
+ * in handed_bytes too once they are waiting for Python. When the loop has a memory budget and
+ * goes over it transfers pause and new requests queue, once releasing brings it back down to
+ * half the budget, or Python's share down to half, the loop is woken to carry on */
+
+static void budget_wake(EventLoop *loop);
+
+static inline void buffered_add(Session *session, long long len)
+{
+    __atomic_add_fetch(&session->buffered_bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&session->loop->buffered_bytes, len, __ATOMIC_SEQ_CST);
+}
+
+/* Bytes the loop thread throws away before handing them over, an interim 1xx response or a
+ * redirect it follows */
+
+static inline void buffered_drop(Session *session, long long len)
+{
+    __atomic_sub_fetch(&session->buffered_bytes, len, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&session->loop->buffered_bytes, len, __ATOMIC_SEQ_CST);
+}
+
+/* From any thread, the loop thread never needs the wake up */
+
+static void buffered_sub(Session *session, long long len)
+{
+    EventLoop *loop = session->loop;
+    __atomic_sub_fetch(&session->buffered_bytes, len, __ATOMIC_RELAXED);
+    long long handed = __atomic_sub_fetch(&loop->handed_bytes, len, __ATOMIC_SEQ_CST);
+    long long buffered = __atomic_sub_fetch(&loop->buffered_bytes, len, __ATOMIC_SEQ_CST);
+    if((buffered <= loop->memory_budget / 2 || handed <= loop->memory_budget / 2) && __atomic_load_n(&loop->budget_blocked, __ATOMIC_SEQ_CST) &&
+       __atomic_exchange_n(&loop->budget_blocked, 0, __ATOMIC_SEQ_CST)) {
+        budget_wake(loop);
+    }
+}
+
+static inline bool budget_exceeded(EventLoop *loop)
+{
+    return loop->memory_budget > 0 && __atomic_load_n(&loop->buffered_bytes, __ATOMIC_SEQ_CST) > loop->memory_budget;
+}
+
+/* Over the budget with most of it waiting for Python, only Python releasing it makes room */
+
+static inline bool budget_held_by_python(EventLoop *loop)
+{
+    return __atomic_load_n(&loop->handed_bytes, __ATOMIC_SEQ_CST) > loop->memory_budget / 2;
+}
+
+/* Before pausing or queueing, set budget_blocked and look again, buffered_sub may have gone
+ * below the budget before it could see the flag. Loop thread only */
+
+static bool budget_block(EventLoop *loop)
+{
+    __atomic_store_n(&loop->budget_blocked, 1, __ATOMIC_SEQ_CST);
+    return budget_exceeded(loop);
+}
+
+static inline void buffer_release_received(Session *session, Buffer *buffer)
+{
+    if(buffer->len > 0) {
+        buffered_sub(session, (long long)buffer->len);
+    }
+    buffer_release(session->loop, buffer);
+}
+
+/* Free every pooled block, when the loop goes */
+
+static void buffer_pool_free(EventLoop *loop)
+{
+    buffer_block_collect(loop);
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        while(loop->free_buffers[i] != NULL) {
+            StackNode *next = loop->free_buffers[i]->next;
+            loop->buffer_memory -= container_of(loop->free_buffers[i], BufferBlock, node)->size;
+            free(container_of(loop->free_buffers[i], BufferBlock, node));
+            loop->free_buffers[i] = next;
+        }
+        loop->free_buffers_len[i] = 0;
+    }
+}
+
+
+/* What body_callback and header_callback keep of a response. With the body discarded only its
+ * length, and its checksum when asked for, are kept */
+
+#define REQUEST_DISCARD_BODY 1
+#define REQUEST_DISCARD_HEADERS 2
+#define REQUEST_CHECKSUM 4
+
+/* Where the body goes instead, written from the loop thread as it arrives */
+
+#define SINK_NONE 0
+#define SINK_FD 1 /* batched pwrite()s, or write()s when the fd can't seek */
+#define SINK_BUFFER 2 /* straight into a writable buffer, e.g. a bytearray */
+#define SINK_BATCH_SIZE (256 * 1024)
+
+/* Where the request body comes from when it isn't held in memory, read by curl through
+ * upload_callback on the loop thread */
+
+#define UPLOAD_NONE 0
+#define UPLOAD_FD 1 /* pread()s into curl's buffer, or read()s when the fd can't seek */
+#define UPLOAD_CHUNKS 2 /* chunks handed over by the Python side through Session.upload */
+#define UPLOAD_HIGH_WATER (1 << 20) /* Session.upload tells the feeder to wait with this much queued */
+
+#define REQUEST_INLINE_STRINGS 512
+#define REQUEST_SLAB_SIZE 64 /* AcRequestData per malloc */
+
+/* Where a request is as far as its event loop thread knows, only touched by that thread */
+
+#define REQUEST_QUEUED 0
+#define REQUEST_RUNNING 1
+#define REQUEST_DONE 2
+
+
+/* A redirect the loop thread followed, for Response.history */
+
+typedef struct {
+    long status;
+    curl_off_t total_time; /* microseconds */
+    char *url;
+} RedirectHop;
+
+/* What the Response properties report, read from the easy handle when the transfer completes so
+ * the handle can go straight back to the pool */
+
+typedef struct {
+    long status;
+    long redirect_count; /* followed by curl itself, the loop's redirects are in RedirectHop */
+    long num_connects; /* new connections the transfer made */
+    curl_off_t total_time; /* microseconds */
+    curl_off_t namelookup_time;
+    curl_off_t connect_time;
+    curl_off_t appconnect_time;
+    curl_off_t pretransfer_time;
+    curl_off_t starttransfer_time;
+    curl_off_t size_upload;
+    curl_off_t size_download;
+    curl_off_t content_length; /* -1 when not known */
+    char *effective_url; /* the start of one allocation holding redirect_url too */
+    char *redirect_url; /* NULL if none */
+    char primary_ip[48];
+} TransferInfo;
+
+typedef struct AcRequestData {
+    StackNode completed;
+    StackNode cancel; /* in the loop's cancelled_requests stack */
+    int cancel_requested; /* cancel was pushed, at most once */
+    uintptr_t serial; /* matches the handle Session.request returned while in the session's in_flight list, 0 after */
+    int refs; /* the request itself and a pending cancellation, either thread frees on the last */
+    int state;
+    bool cancelled;
+    struct AcRequestData *in_flight_prev; /* in the session's in_flight list */
+    struct AcRequestData *in_flight_next;
+    char* method;
+    char* url;
+    char* auth;
+    struct curl_slist* cookies; /* Netscape cookie lines to add to the jar, nodes from request_line_alloc */
+    PyObject* future;
+    struct curl_slist* headers; /* nodes from request_line_alloc */
+    Py_ssize_t req_data_len;
+    const char *req_data_buf;
+    Py_buffer req_data; /* the body, held by reference until completion, obj is set while held */
+    Session* session;
+    EasyHandle *handle;
+    CURL *curl;
+    CURLcode result;
+    Buffer header_buffer;
+    Buffer body_buffer;
+    int body_flags; /* REQUEST_DISCARD_BODY, REQUEST_DISCARD_HEADERS, REQUEST_CHECKSUM */
+    long long body_length;
+    uint32_t checksum;
+    int sink; /* SINK_NONE, SINK_FD or SINK_BUFFER */
+    int sink_fd;
+    long long sink_offset; /* of the body's first byte in the file, -1 to write() at the fd's offset */
+    long long sink_written;
+    Py_buffer sink_view; /* obj is set while held */
+    bool sink_preallocate;
+    bool sink_overflow; /* the body didn't fit the buffer */
+    int sink_errno; /* writing to the fd failed */
+    int upload; /* UPLOAD_NONE, UPLOAD_FD or UPLOAD_CHUNKS */
+    int upload_fd;
+    long long upload_offset; /* of the body's first byte in the file, -1 to read() at the fd's offset */
+    long long upload_size; /* -1 when not known, sent chunked */
+    long long upload_sent;
+    int upload_errno; /* reading the fd failed */
+    PyObject *upload_feeder; /* pushes the chunks and is told when they have drained */
+    Stack upload_pushed; /* UploadChunks from Session.upload */
+    StackNode *upload_head; /* the ones taken from upload_pushed, oldest first, loop thread only */
+    StackNode *upload_tail;
+    size_t upload_head_offset; /* sent from the head chunk */
+    long long upload_queued; /* bytes pushed and not sent yet */
+    int upload_eof; /* set by Session.upload after the last chunk */
+    int upload_paused; /* set by the loop thread, read by Session.upload */
+    int upload_waiting; /* the feeder waits for the queue to drain */
+    PyObject *stream; /* gets the headers and body as they arrive, NULL unless streamed */
+    long long stream_high_water; /* pause the transfer with this much not read yet */
+    long long stream_unconsumed; /* bytes handed to the Python side and not read yet */
+    int stream_paused; /* set by the loop thread, read by Session.consumed */
+    int stream_resuming; /* in the loop's resumed_streams stack */
+    StackNode resume;
+    bool stream_headers_ready; /* the final header block is complete */
+    bool stream_headers_sent;
+    bool stream_dirty; /* in the loop's dirty_streams list */
+    struct AcRequestData *stream_dirty_next;
+    bool budget_paused; /* in the loop's budget_paused list */
+    struct AcRequestData *budget_next; /* in budget_paused or budget_queued */
+    long timeout_ms; /* 0 for none */
+    long connect_timeout_ms;
+    long stall_timeout_ms;
+    const char *timeout_phase; /* which of them expired, for CURLE_OPERATION_TIMEDOUT */
+    TransferInfo info; /* taken when the request completes successfully */
+    int max_redirects; /* followed by the loop thread, -1 to leave them to the Python side */
+    RedirectHop *redirects; /* followed so far, oldest first */
+    int redirects_len;
+    curl_off_t redirect_elapsed; /* microseconds taken by the redirects, counted against timeout_ms */
+    const char *redirect_error; /* why a redirect couldn't be followed */
+    int requested_sink; /* sink and body_flags as asked for, restored for each hop */
+    int requested_body_flags;
+    size_t strings_used;
+    /* method, url, auth, header and cookie lines when they fit, last so it isn't zeroed */
+    char strings[REQUEST_INLINE_STRINGS] __attribute__((aligned(sizeof(void *))));
+} AcRequestData;
+
+/* What a streamed request received during one run of curl, handed to the Python side through
+ * the completion queue. The headers come with the first one */
+
+typedef struct {
+    StackNode node;
+    AcRequestData *rd;
+    long status; /* -1 unless the headers are in this batch */
+    Buffer header;
+    Buffer data;
+    bool upload_drained; /* nothing received, the request's upload queue went below half the high water mark */
+} StreamBatch;
+
+/* A piece of a request body pushed by Session.upload, copied so the loop thread can free it */
+
+typedef struct {
+    StackNode node;
+    size_t len;
+    char data[];
+} UploadChunk;
+
+
+typedef struct Response {
+    PyObject_HEAD
+    Buffer header_buffer;
+    Buffer body_buffer;
+    PyObject *body; /* bytes, once asked for, and the body buffer handed back */
+    int exports; /* buffer protocol views of body_buffer */
+    int body_flags;
+    long long body_length;
+    uint32_t checksum;
+    Session *session;
+    TransferInfo info;
+    RedirectHop *redirects; /* followed by the loop thread, NULL if none */
+    int redirects_len;
+    struct Response *free_next; /* in the freelist */
+} Response;
+
+#define RESPONSE_FREELIST_MAX 1024
+
+
+static PyObject *RequestError;
+static PyObject *RequestTimeout;
+static long long curl_memory; /* bytes allocated by libcurl */
+static long long request_allocations; /* request data slabs and strings that didn't fit inline */
+static uintptr_t request_serial; /* last given to a request, GIL */
+static long long response_allocations; /* Response objects not taken from the freelist */
+static PyObject *str_set_result;
+static PyObject *str_set_exception;
+static PyObject *str_cancelled;
+static PyObject *str_add_reader;
+static PyObject *str_remove_reader;
+static PyObject *str_add_writer;
+static PyObject *str_remove_writer;
+static PyObject *str_call_later;
+static PyObject *str_call_soon;
+static PyObject *str_cancel;
+static PyObject *str_on_headers;
+static PyObject *str_on_data;
+static PyObject *str_on_drained;
+static PyObject *str_format;
+
+
+/* Python deallocator for Response Object. For GC */
+
+/* Deallocated responses are kept for the next ones, like CPython's own freelists. GIL */
+
+static Response *response_freelist;
+static int response_freelist_len;
+
+static void redirect_hops_free(RedirectHop *hops, int len)
+{
+    for(int i = 0; i < len; i++) {
+        free(hops[i].url);
+    }
+    free(hops);
+}
+
+static void transfer_info_free(TransferInfo *info)
+{
+    free(info->effective_url);
+}
+
+static void Response_dealloc(Response *self)
+{
+    ENTER();
+    DEBUG_PRINT("response=%p", self);
+    buffer_release_received(self->session, &self->header_buffer);
+    buffer_release_received(self->session, &self->body_buffer);
+    Py_XDECREF(self->body);
+    redirect_hops_free(self->redirects, self->redirects_len);
+    transfer_info_free(&self->info);
+    Py_XDECREF(self->session);
+    if(response_freelist_len < RESPONSE_FREELIST_MAX) {
+        self->free_next = response_freelist;
+        response_freelist = self;
+        response_freelist_len++;
+    }
+    else {
+        Py_TYPE(self)->tp_free((PyObject*)self);
+    }
+    EXIT();
+}
+
+
+PyObject * get_buffer_as_pybytes(Buffer *buffer)
+{
+    if(buffer->block == NULL) {
+        return PyBytes_FromStringAndSize(NULL, 0);
+    }
+    return PyBytes_FromStringAndSize(buffer->block->data, buffer->len);
+}
+
+
+static PyObject *
+Response_get_header(Response *self, PyObject *args)
+{   
+    ENTER();
+    DEBUG_PRINT("");
+    PyObject *rtn = get_buffer_as_pybytes(&self->header_buffer);
+    EXIT();
+    return rtn;
+}
+
+
+/* The bytes are made once, with a single copy out of the body buffer, which then goes back to
+ * the pool unless a view of it is still exported */
+
+static PyObject *
+Response_get_body(Response *self, PyObject *args)
+{
+    ENTER();
+    DEBUG_PRINT("");
+    if(self->body == NULL) {
+        self->body = get_buffer_as_pybytes(&self->body_buffer);
+        if(self->body == NULL) {
+            EXIT();
+            return NULL;
+        }
+        if(self->exports == 0) {
+            buffer_release_received(self->session, &self->body_buffer);
+        }
+    }
+    Py_INCREF(self->body);
+    EXIT();
+    return self->body;
+}
+
+
+static PyObject *
+Response_get_body_view(Response *self, PyObject *args)
+{
+    return PyMemoryView_FromObject((PyObject *)self);
+}
+
+
+static PyObject *
+Response_get_body_length(Response *self, PyObject *args)
+{
+    return PyLong_FromLongLong(self->body_length);
+}
+
+
+static PyObject *
+Response_get_checksum(Response *self, PyObject *args)
+{
+    if(!(self->body_flags & REQUEST_CHECKSUM)) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromUnsignedLong(self->checksum);
+}
+
+/* Buffer protocol, a read only view of the body wherever it is held, without copying it */
+
+static int
+Response_getbuffer(Response *self, Py_buffer *view, int flags)
+{
+    void *data;
+    Py_ssize_t len;
+    if(self->body != NULL) {
+        data = PyBytes_AS_STRING(self->body);
+        len = PyBytes_GET_SIZE(self->body);
+    }
+    else if(self->body_buffer.block != NULL) {
+        data = self->body_buffer.block->data;
+        len = self->body_buffer.len;
+    }
+    else {
+        data = "";
+        len = 0;
+    }
+    if(PyBuffer_FillInfo(view, (PyObject *)self, data, len, 1, flags) < 0) {
+        return -1;
+    }
+    self->exports++;
+    return 0;
+}
+
+
+static void
+Response_releasebuffer(Response *self, Py_buffer *view)
+{
+    self->exports--;
+}
+
+
+static PyBufferProcs Response_as_buffer = {
+    (getbufferproc)Response_getbuffer,
+    (releasebufferproc)Response_releasebuffer,
+};
+
+
+/* Transfer times are kept in microseconds and reported in seconds, like curl's double ones */
+
+static inline PyObject *info_seconds(curl_off_t microseconds)
+{
+    return PyFloat_FromDouble((double)microseconds / 1e6);
+}
+
+static inline PyObject *info_string(const char *value)
+{
+    if(value == NULL) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(value);
+}
+
+static PyObject *Response_get_effective_url(Response *self, PyObject *args)
+{
+    return info_string(self->info.effective_url);
+}
+
+static PyObject *Response_get_response_code(Response *self, PyObject *args)
+{
+    return PyLong_FromLong(self->info.status);
+}
+
+static PyObject *Response_get_total_time(Response *self, PyObject *args)
+{
+    return info_seconds(self->info.total_time);
+}
+
+static PyObject *Response_get_namelookup_time(Response *self, PyObject *args)
+{
+    return info_seconds(self->info.namelookup_time);
+}
+
+static PyObject *Response_get_connect_time(Response *self, PyObject *args)
+{
+    return info_seconds(self->info.connect_time);
+}
+
+static PyObject *Response_get_appconnect_time(Response *self, PyObject *args)
+{
+    return info_seconds(self->info.appconnect_time);
+}
+
+static PyObject *Response_get_pretransfer_time(Response *self, PyObject *args)
+{
+    return info_seconds(self->info.pretransfer_time);
+}
+
+static PyObject *Response_get_starttransfer_time(Response *self, PyObject *args)
+{
+    return info_seconds(self->info.starttransfer_time);
+}
+
+static PyObject *Response_get_size_upload(Response *self, PyObject *args)
+{
+    return PyFloat_FromDouble((double)self->info.size_upload);
+}
+
+static PyObject *Response_get_size_download(Response *self, PyObject *args)
+{
+    return PyFloat_FromDouble((double)self->info.size_download);
+}
+
+static PyObject *Response_get_content_length(Response *self, PyObject *args)
+{
+    if(self->info.content_length < 0) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromLongLong((long long)self->info.content_length);
+}
+
+static PyObject *Response_get_redirect_count(Response *self, PyObject *args)
+{
+    return PyLong_FromLong(self->info.redirect_count);
+}
+
+static PyObject *Response_get_num_connects(Response *self, PyObject *args)
+{
+    return PyLong_FromLong(self->info.num_connects);
+}
+
+static PyObject *Response_get_primary_ip(Response *self, PyObject *args)
+{
+    return PyUnicode_FromString(self->info.primary_ip);
+}
+
+/* The cookie jar is the session's, read as it is now rather than when the response completed */
+
+static PyObject *Response_get_cookielist(Response *self, PyObject *args)
+{
+    return jar_export(session_share(self->session), false);
+}
+
+static PyObject *Response_get_cookies(Response *self, PyObject *args)
+{
+    return jar_export(session_share(self->session), true);
+}
+
+static PyObject *Response_get_redirect_url(Response *self, PyObject *args)
+{
+    return info_string(self->info.redirect_url);
+}
+
+static PyObject *Response_get_redirects(Response *self, PyObject *args)
+{
+    ENTER();
+    PyObject *rtn = PyTuple_New(self->redirects_len);
+    for(int i = 0; rtn != NULL && i < self->redirects_len; i++) {
+        RedirectHop *hop = &self->redirects[i];
+        PyObject *item = Py_BuildValue("(lsd)", hop->status, hop->url, hop->total_time / 1e6);
+        if(item == NULL) {
+            Py_CLEAR(rtn);
+            break;
+        }
+        PyTuple_SET_ITEM(rtn, i, item);
+    }
+    EXIT();
+    return rtn;
+}
+
+
+
+/* Response headers, parsed once from the header buffer into an index of offsets and looked up
+ * case insensitively without building a dict. Like a multidict: duplicates (Set-Cookie) are
+ * kept in order, [] and get return the first, getall every one. Only the last header block is
+ * indexed, earlier ones are interim 1xx responses or proxy CONNECT replies. */
+
+typedef struct {
+    uint32_t name;
+    uint32_t name_len;
+    uint32_t value;
+    uint32_t value_len;
+} HeaderField;
+
+typedef struct {
+    PyObject_VAR_HEAD /* ob_size is the number of fields */
+    PyObject *owner; /* keeps data alive */
+    const char *data;
+    Py_ssize_t status_line; /* -1 without one */
+    Py_ssize_t status_line_len;
+    HeaderField fields[];
+} Headers;
+
+static PyTypeObject HeadersType;
+
+#define HEADER_FIELDS_ON_STACK 64
+
+static inline bool header_is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/* Header names are ASCII, so case is folded by hand whatever the locale */
+
+static inline bool header_equal_nocase(const char *a, const char *b, Py_ssize_t len)
+{
+    for(Py_ssize_t i = 0; i < len; i++) {
+        char x = a[i] >= 'A' && a[i] <= 'Z' ? a[i] + 32 : a[i];
+        char y = b[i] >= 'A' && b[i] <= 'Z' ? b[i] + 32 : b[i];
+        if(x != y) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Lines are found with memchr, which libc vectorises, only the name is looked at byte by byte */
+
+static PyObject *headers_new(PyObject *owner, const char *data, Py_ssize_t len)
+{
+    HeaderField on_stack[HEADER_FIELDS_ON_STACK];
+    HeaderField *fields = on_stack;
+    Py_ssize_t capacity = HEADER_FIELDS_ON_STACK, count = 0;
+    Py_ssize_t status_line = -1, status_line_len = 0;
+    Py_ssize_t pos = 0;
+    while(pos < len) {
+        const char *newline = memchr(data + pos, '\n', len - pos);
+        Py_ssize_t end = newline != NULL ? newline - data : len;
+        Py_ssize_t next = end + 1;
+        if(end > pos && data[end - 1] == '\r') {
+            end--;
+        }
+        if(end - pos >= 5 && memcmp(data + pos, "HTTP/", 5) == 0) {
+            status_line = pos;
+            status_line_len = end - pos;
+            count = 0;
+        }
+        else if(end > pos && !header_is_space(data[pos])) {
+            const char *colon = memchr(data + pos, ':', end - pos);
+            if(colon != NULL) {
+                Py_ssize_t name_end = colon - data, value = name_end + 1, value_end = end;
+                while(name_end > pos && header_is_space(data[name_end - 1])) {
+                    name_end--;
+                }
+                while(value < value_end && header_is_space(data[value])) {
+                    value++;
+                }
+                while(value_end > value && header_is_space(data[value_end - 1])) {
+                    value_end--;
+                }
+                if(count == capacity) {
+                    HeaderField *grown = (HeaderField *)PyMem_Malloc(sizeof(HeaderField) * capacity * 2);
+                    if(grown == NULL) {
+                        if(fields != on_stack) {
+                            PyMem_Free(fields);
+                        }
+                        return PyErr_NoMemory();
+                    }
+                    memcpy(grown, fields, sizeof(HeaderField) * count);
+                    if(fields != on_stack) {
+                        PyMem_Free(fields);
+                    }
+                    fields = grown;
+                    capacity *= 2;
+                }
+                fields[count].name = pos;
+                fields[count].name_len = name_end - pos;
+                fields[count].value = value;
+                fields[count].value_len = value_end - value;
+                count++;
+            }
+        }
+        pos = next;
+    }
+    Headers *self = PyObject_NewVar(Headers, &HeadersType, count);
+    if(self != NULL) {
+        Py_INCREF(owner);
+        self->owner = owner;
+        self->data = data;
+        self->status_line = status_line;
+        self->status_line_len = status_line_len;
+        memcpy(self->fields, fields, sizeof(HeaderField) * count);
+    }
+    if(fields != on_stack) {
+        PyMem_Free(fields);
+    }
+    return (PyObject *)self;
+}
+
+
+static PyObject *
+Headers_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *header;
+    static char *kwlist[] = {"header", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "S", kwlist, &header)) {
+        return NULL;
+    }
+    return headers_new(header, PyBytes_AS_STRING(header), PyBytes_GET_SIZE(header));
+}
+
+
+static void
+Headers_dealloc(Headers *self)
+{
+    Py_XDECREF(self->owner);
+    PyObject_Free(self);
+}
+
+/* Index of the first field named name at or after start, -1 if there is none */
+
+static Py_ssize_t headers_find(Headers *self, const char *name, Py_ssize_t name_len, Py_ssize_t start)
+{
+    for(Py_ssize_t i = start; i < Py_SIZE(self); i++) {
+        HeaderField *field = &self->fields[i];
+        if(field->name_len == name_len && header_equal_nocase(self->data + field->name, name, name_len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline PyObject *header_string(Headers *self, uint32_t offset, uint32_t len)
+{
+    return PyUnicode_DecodeLatin1(self->data + offset, len, NULL);
+}
+
+static PyObject *headers_value(Headers *self, PyObject *key, bool raise)
+{
+    Py_ssize_t name_len;
+    const char *name = PyUnicode_Check(key) ? PyUnicode_AsUTF8AndSize(key, &name_len) : NULL;
+    if(name == NULL) {
+        PyErr_Clear();
+    }
+    Py_ssize_t i = name != NULL ? headers_find(self, name, name_len, 0) : -1;
+    if(i < 0) {
+        if(raise) {
+            PyErr_SetObject(PyExc_KeyError, key);
+        }
+        return NULL;
+    }
+    return header_string(self, self->fields[i].value, self->fields[i].value_len);
+}
+
+
+static Py_ssize_t
+Headers_length(Headers *self)
+{
+    return Py_SIZE(self);
+}
+
+
+static PyObject *
+Headers_subscript(Headers *self, PyObject *key)
+{
+    return headers_value(self, key, true);
+}
+
+
+static int
+Headers_contains(Headers *self, PyObject *key)
+{
+    Py_ssize_t name_len;
+    const char *name = PyUnicode_Check(key) ? PyUnicode_AsUTF8AndSize(key, &name_len) : NULL;
+    if(name == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+    return headers_find(self, name, name_len, 0) >= 0;
+}
+
+
+static PyObject *
+Headers_get(Headers *self, PyObject *args)
+{
+    PyObject *key, *default_value = Py_None;
+    if(!PyArg_ParseTuple(args, "O|O", &key, &default_value)) {
+        return NULL;
+    }
+    PyObject *value = headers_value(self, key, false);
+    if(value == NULL && !PyErr_Occurred()) {
+        Py_INCREF(default_value);
+        return default_value;
+    }
+    return value;
+}
+
+
+static PyObject *
+Headers_getall(Headers *self, PyObject *key)
+{
+    Py_ssize_t name_len;
+    const char *name = PyUnicode_Check(key) ? PyUnicode_AsUTF8AndSize(key, &name_len) : NULL;
+    if(name == NULL) {
+        PyErr_Clear();
+        return PyList_New(0);
+    }
+    PyObject *values = PyList_New(0);
+    for(Py_ssize_t i = headers_find(self, name, name_len, 0); values != NULL && i >= 0; i = headers_find(self, name, name_len, i + 1)) {
+        PyObject *value = header_string(self, self->fields[i].value, self->fields[i].value_len);
+        if(value == NULL || PyList_Append(values, value) < 0) {
+            Py_CLEAR(values);
+        }
+        Py_XDECREF(value);
+    }
+    return values;
+}
+
+/* Names, values or (name, value) pairs of every field, in order */
+
+#define HEADERS_KEYS 1
+#define HEADERS_VALUES 2
+
+static PyObject *headers_list(Headers *self, int what)
+{
+    PyObject *list = PyList_New(Py_SIZE(self));
+    for(Py_ssize_t i = 0; list != NULL && i < Py_SIZE(self); i++) {
+        HeaderField *field = &self->fields[i];
+        PyObject *item;
+        if(what == HEADERS_KEYS) {
+            item = header_string(self, field->name, field->name_len);
+        }
+        else if(what == HEADERS_VALUES) {
+            item = header_string(self, field->value, field->value_len);
+        }
+        else {
+            PyObject *name = header_string(self, field->name, field->name_len);
+            PyObject *value = header_string(self, field->value, field->value_len);
+            item = name != NULL && value != NULL ? PyTuple_Pack(2, name, value) : NULL;
+            Py_XDECREF(name);
+            Py_XDECREF(value);
+        }
+        if(item == NULL) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
+
+static PyObject *
+Headers_keys(Headers *self, PyObject *args)
+{
+    return headers_list(self, HEADERS_KEYS);
+}
+
+
+static PyObject *
+Headers_values(Headers *self, PyObject *args)
+{
+    return headers_list(self, HEADERS_VALUES);
+}
+
+
+static PyObject *
+Headers_items(Headers *self, PyObject *args)
+{
+    return headers_list(self, HEADERS_KEYS | HEADERS_VALUES);
+}
+
+
+static PyObject *
+Headers_iter(Headers *self)
+{
+    PyObject *keys = headers_list(self, HEADERS_KEYS);
+    if(keys == NULL) {
+        return NULL;
+    }
+    PyObject *iter = PyObject_GetIter(keys);
+    Py_DECREF(keys);
+    return iter;
+}
+
+
+static PyObject *
+Headers_get_status_line(Headers *self, void *closure)
+{
+    if(self->status_line < 0) {
+        Py_RETURN_NONE;
+    }
+    return header_string(self, self->status_line, self->status_line_len);
+}
+
+/* Content-Type without its parameters */
+
+static PyObject *
+Headers_get_content_type(Headers *self, void *closure)
+{
+    Py_ssize_t i = headers_find(self, "content-type", 12, 0);
+    if(i < 0) {
+        Py_RETURN_NONE;
+    }
+    const char *value = self->data + self->fields[i].value;
+    uint32_t len = self->fields[i].value_len;
+    const char *semicolon = memchr(value, ';', len);
+    if(semicolon != NULL) {
+        len = semicolon - value;
+    }
+    while(len > 0 && header_is_space(value[len - 1])) {
+        len--;
+    }
+    return header_string(self, self->fields[i].value, len);
+}
+
+/* The charset parameter of Content-Type, unquoted */
+
+static PyObject *
+Headers_get_charset(Headers *self, void *closure)
+{
+    Py_ssize_t i = headers_find(self, "content-type", 12, 0);
+    if(i < 0) {
+        Py_RETURN_NONE;
+    }
+    const char *value = self->data + self->fields[i].value;
+    const char *end = value + self->fields[i].value_len;
+    const char *param = memchr(value, ';', end - value);
+    while(param != NULL) {
+        param++;
+        while(param < end && header_is_space(*param)) {
+            param++;
+        }
+        if(end - param > 8 && header_equal_nocase(param, "charset=", 8)) {
+            const char *start = param + 8, *stop = start;
+            while(stop < end && *stop != ';' && !header_is_space(*stop)) {
+                stop++;
+            }
+            if(stop - start >= 2 && *start == '"' && stop[-1] == '"') {
+                start++;
+                stop--;
+            }
+            return header_string(self, start - self->data, stop - start);
+        }
+        param = memchr(param, ';', end - param);
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyMethodDef Headers_methods[] = {
+    {"get", (PyCFunction)Headers_get, METH_VARARGS, "Get the first value of a header, or default"},
+    {"getall", (PyCFunction)Headers_getall, METH_O, "Get every value of a header, in order"},
+    {"keys", (PyCFunction)Headers_keys, METH_NOARGS, "Get the name of every field, in order"},
+    {"values", (PyCFunction)Headers_values, METH_NOARGS, "Get the value of every field, in order"},
+    {"items", (PyCFunction)Headers_items, METH_NOARGS, "Get (name, value) of every field, in order"},
+    {NULL, NULL, 0, NULL}
+};
+
+
+static PyGetSetDef Headers_getset[] = {
+    {"status_line", (getter)Headers_get_status_line, NULL, "The status line, e.g. HTTP/1.1 200 OK", NULL},
+    {"content_type", (getter)Headers_get_content_type, NULL, "The media type of Content-Type, without parameters", NULL},
+    {"charset", (getter)Headers_get_charset, NULL, "The charset parameter of Content-Type", NULL},
+    {NULL}
+};
+
+
+static PyMappingMethods Headers_as_mapping = {
+    (lenfunc)Headers_length,
+    (binaryfunc)Headers_subscript,
+    0,
+};
+
+
+static PySequenceMethods Headers_as_sequence = {
+    0, 0, 0, 0, 0, 0, 0,
+    (objobjproc)Headers_contains,
+};
+
+
+static PyTypeObject HeadersType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_acurl.Headers",          /* tp_name */
+    offsetof(Headers, fields), /* tp_basicsize */
+    sizeof(HeaderField),       /* tp_itemsize */
+    (destructor)Headers_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_reserved */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    &Headers_as_sequence,      /* tp_as_sequence */
+    &Headers_as_mapping,       /* tp_as_mapping */
+    0,                         /* tp_hash  */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,        /* tp_flags */
+    "Case insensitive read only view of response headers, parsed from a header block", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    (getiterfunc)Headers_iter, /* tp_iter */
+    0,                         /* tp_iternext */
+    Headers_methods,           /* tp_methods */
+    0,                         /* tp_members */
+    Headers_getset,            /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    Headers_new,               /* tp_new */
+};
+
+
+static PyObject *
+Response_get_headers(Response *self, PyObject *args)
+{
+    Buffer *header = &self->header_buffer;
+    return headers_new((PyObject *)self, header->block != NULL ? header->block->data : "", header->len);
 }
 
 
@@ -378,234 +1651,1574 @@ static PyMethodDef Response_methods[] = {
     {"get_starttransfer_time", (PyCFunction)Response_get_starttransfer_time, METH_NOARGS, "Get elapsed time from start of request until the first byte is recieved in seconds"},
     {"get_size_upload", (PyCFunction)Response_get_size_upload, METH_NOARGS, ""},
     {"get_size_download", (PyCFunction)Response_get_size_download, METH_NOARGS, ""},
+    {"get_content_length", (PyCFunction)Response_get_content_length, METH_NOARGS, "Get the Content-Length the server sent, or None"},
+    {"get_redirect_count", (PyCFunction)Response_get_redirect_count, METH_NOARGS, "Get the number of redirects curl followed"},
+    {"get_num_connects", (PyCFunction)Response_get_num_connects, METH_NOARGS, "Get the number of new connections the transfer made"},
     {"get_primary_ip", (PyCFunction)Response_get_primary_ip, METH_NOARGS, ""},
     {"get_cookielist", (PyCFunction)Response_get_cookielist, METH_NOARGS, ""},
+    {"get_cookies", (PyCFunction)Response_get_cookies, METH_NOARGS, "Get the session's cookies as (http_only, domain, include_subdomains, path, is_secure, expiration, name, value) tuples"},
     {"get_redirect_url", (PyCFunction)Response_get_redirect_url, METH_NOARGS, "Get the redirect URL or None"},
-    {"get_header", (PyCFunction)Response_get_header, METH_NOARGS, "Get the header"},
-    {"get_body", (PyCFunction)Response_get_body, METH_NOARGS, "Get the body"},
+    {"get_redirects", (PyCFunction)Response_get_redirects, METH_NOARGS, "Get the redirects followed by the event loop, (status, url, total_time) each"},
+    {"get_header", (PyCFunction)Response_get_header, METH_NOARGS, "Get the header as bytes"},
+    {"get_headers", (PyCFunction)Response_get_headers, METH_NOARGS, "Get the headers of the final response as a Headers mapping"},
+    {"get_body", (PyCFunction)Response_get_body, METH_NOARGS, "Get the body as bytes"},
+    {"get_body_view", (PyCFunction)Response_get_body_view, METH_NOARGS, "Get a read only memoryview of the body, without copying it"},
+    {"get_body_length", (PyCFunction)Response_get_body_length, METH_NOARGS, "Get the number of body bytes received, kept or discarded"},
+    {"get_checksum", (PyCFunction)Response_get_checksum, METH_NOARGS, "Get the Adler-32 checksum of the body, or None when not asked for"},
+    {NULL, NULL, 0, NULL}
+};
+
+
+static PyMemberDef Response_members[] = {
+    {NULL}
+};
+
+
+static PyTypeObject ResponseType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_acurl.Response",           /* tp_name */
+    sizeof(Response),           /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)Response_dealloc,           /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_reserved */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash  */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    &Response_as_buffer,       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,        /* tp_flags */
+    "Response Type",           /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    Response_methods,          /* tp_methods */
+    Response_members,          /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+};
+
+static PyObject *
+CompletionQueue_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    ENTER();
+    CompletionQueue *self = (CompletionQueue *)type->tp_alloc(type, 0);
+    if(self != NULL) {
+        self->completed.head = NULL;
+        self->streamed.head = NULL;
+        doorbell_init(&self->doorbell);
+    }
+    EXIT();
+    return (PyObject *)self;
+}
+
+
+static void
+CompletionQueue_dealloc(CompletionQueue *self)
+{
+    ENTER();
+    doorbell_free(&self->doorbell);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+    EXIT();
+}
+
+
+static PyObject *
+CompletionQueue_fileno(PyObject *self, PyObject *args)
+{
+    ENTER();
+    PyObject *rtn = PyLong_FromLong(((CompletionQueue*)self)->doorbell.read_fd);
+    EXIT();
+    return rtn;
+}
+
+
+/* Resolve a future, a future that has already been cancelled is left alone */
+
+static void resolve_future(PyObject *future, PyObject *method, PyObject *value)
+{
+    PyObject *rtn = PyObject_CallMethodObjArgs(future, method, value, NULL);
+    if(rtn != NULL) {
+        Py_DECREF(rtn);
+        return;
+    }
+    PyObject *cancelled = PyObject_CallMethodObjArgs(future, str_cancelled, NULL);
+    if(cancelled == Py_True) {
+        PyErr_Clear();
+    }
+    else {
+        PyErr_WriteUnraisable(future);
+    }
+    Py_XDECREF(cancelled);
+}
+
+static inline void session_in_flight_remove(Session *session, AcRequestData *rd)
+{
+    if(rd->in_flight_prev != NULL) {
+        rd->in_flight_prev->in_flight_next = rd->in_flight_next;
+    }
+    else {
+        session->in_flight = rd->in_flight_next;
+    }
+    if(rd->in_flight_next != NULL) {
+        rd->in_flight_next->in_flight_prev = rd->in_flight_prev;
+    }
+    session->in_flight_len--;
+    rd->serial = 0; /* its handle no longer finds it */
+}
+
+/* AcRequestData comes from slabs that are never freed, so the pool grows to the most requests
+ * alive at once. Taken by Session.request with the GIL held, given back by whichever thread
+ * drops the last reference onto a lock-free stack */
+
+static struct {
+    Stack returned;
+    StackNode *free; /* GIL */
+} request_pool;
+
+static AcRequestData *request_data_alloc(void)
+{
+    if(request_pool.free == NULL) {
+        request_pool.free = stack_pop_all(&request_pool.returned);
+    }
+    if(request_pool.free == NULL) {
+        AcRequestData *slab = (AcRequestData *)malloc(sizeof(AcRequestData) * REQUEST_SLAB_SIZE);
+        if(slab == NULL) {
+            return NULL;
+        }
+        for(int i = REQUEST_SLAB_SIZE - 1; i >= 0; i--) {
+            slab[i].completed.next = request_pool.free;
+            request_pool.free = &slab[i].completed;
+        }
+        request_allocations++;
+    }
+    AcRequestData *rd = container_of(request_pool.free, AcRequestData, completed);
+    request_pool.free = request_pool.free->next;
+    memset(rd, 0, offsetof(AcRequestData, strings));
+    return rd;
+}
+
+static inline void request_data_free(AcRequestData *rd)
+{
+    stack_push(&request_pool.returned, &rd->completed);
+}
+
+static inline void request_data_release(AcRequestData *rd)
+{
+    if(__atomic_sub_fetch(&rd->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        request_data_free(rd);
+    }
+}
+
+/* Space for a string of the request, in the request when it fits. NULL with MemoryError set when
+ * it doesn't and malloc fails. GIL */
+
+static char *request_string_alloc(AcRequestData *rd, size_t size)
+{
+    if(rd->strings_used + size <= REQUEST_INLINE_STRINGS) {
+        char *str = rd->strings + rd->strings_used;
+        rd->strings_used += size;
+        return str;
+    }
+    request_allocations++;
+    char *str = (char *)malloc(size);
+    if(str == NULL) {
+        PyErr_NoMemory();
+    }
+    return str;
+}
+
+static char *request_strdup(AcRequestData *rd, const char *str)
+{
+    size_t size = strlen(str) + 1;
+    char *copy = request_string_alloc(rd, size);
+    return copy != NULL ? (char *)memcpy(copy, str, size) : NULL;
+}
+
+static inline void request_string_free(AcRequestData *rd, char *str)
+{
+    if(str < rd->strings || str >= rd->strings + REQUEST_INLINE_STRINGS) {
+        free(str);
+    }
+}
+
+/* A curl_slist node with room for a line of len characters after it, for header and cookie lists
+ * built without going through curl_slist_append. NULL with MemoryError set if malloc fails. GIL */
+
+static struct curl_slist *request_line_alloc(AcRequestData *rd, size_t len)
+{
+    size_t offset = (rd->strings_used + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    size_t size = sizeof(struct curl_slist) + len + 1;
+    struct curl_slist *node;
+    if(offset + size <= REQUEST_INLINE_STRINGS) {
+        node = (struct curl_slist *)(rd->strings + offset);
+        rd->strings_used = offset + size;
+    }
+    else {
+        request_allocations++;
+        if((node = (struct curl_slist *)malloc(size)) == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    node->data = (char *)(node + 1);
+    node->data[len] = '\0';
+    node->next = NULL;
+    return node;
+}
+
+/* Either thread, once curl is done with the list */
+
+static void request_lines_free(AcRequestData *rd, struct curl_slist *node)
+{
+    while(node != NULL) {
+        struct curl_slist *next = node->next;
+        request_string_free(rd, (char *)node);
+        node = next;
+    }
+}
+
+/* A Response from the freelist, or a new one. GIL */
+
+static Response *response_alloc(void)
+{
+    Response *response = response_freelist;
+    if(response != NULL) {
+        response_freelist = response->free_next;
+        response_freelist_len--;
+        PyObject_Init((PyObject *)response, (PyTypeObject *)&ResponseType);
+        return response;
+    }
+    response_allocations++;
+    return PyObject_New(Response, (PyTypeObject *)&ResponseType);
+}
+
+/* Free the chunks of a request body that weren't sent, the loop thread is done with them */
+
+static void upload_chunks_free(AcRequestData *rd)
+{
+    StackNode *node = rd->upload_head;
+    while(node != NULL) {
+        StackNode *next = node->next;
+        free(container_of(node, UploadChunk, node));
+        node = next;
+    }
+    rd->upload_head = NULL;
+    node = stack_pop_all(&rd->upload_pushed);
+    while(node != NULL) {
+        StackNode *next = node->next;
+        free(container_of(node, UploadChunk, node));
+        node = next;
+    }
+}
+
+/* Set the result or exception on the future of every completed request */
+
+/* Pass the batches of streamed requests to their stream objects. Each is copied into bytes once
+ * and its buffers go back to the loop's pool */
+
+static void stream_batches_deliver(StackNode *node)
+{
+    while(node != NULL) {
+        StreamBatch *batch = container_of(node, StreamBatch, node);
+        node = node->next;
+        AcRequestData *rd = batch->rd;
+        PyObject *rtn = NULL;
+        if(batch->upload_drained) {
+            rtn = PyObject_CallMethodObjArgs(rd->upload_feeder, str_on_drained, NULL);
+            if(rtn == NULL) {
+                PyErr_WriteUnraisable(rd->upload_feeder);
+            }
+            Py_XDECREF(rtn);
+            free(batch);
+            continue;
+        }
+        if(batch->status >= 0) {
+            PyObject *status = PyLong_FromLong(batch->status);
+            PyObject *header = get_buffer_as_pybytes(&batch->header);
+            if(status != NULL && header != NULL) {
+                rtn = PyObject_CallMethodObjArgs(rd->stream, str_on_headers, status, header, NULL);
+                if(rtn == NULL) {
+                    PyErr_WriteUnraisable(rd->stream);
+                }
+                Py_XDECREF(rtn);
+            }
+            Py_XDECREF(status);
+            Py_XDECREF(header);
+        }
+        if(batch->data.len > 0) {
+            PyObject *data = get_buffer_as_pybytes(&batch->data);
+            if(data != NULL) {
+                rtn = PyObject_CallMethodObjArgs(rd->stream, str_on_data, data, NULL);
+                if(rtn == NULL) {
+                    PyErr_WriteUnraisable(rd->stream);
+                }
+                Py_XDECREF(rtn);
+                Py_DECREF(data);
+            }
+        }
+        buffer_release_received(rd->session, &batch->header);
+        buffer_release_received(rd->session, &batch->data);
+        free(batch);
+    }
+}
+
+static void completion_queue_drain(CompletionQueue *queue)
+{
+    ENTER();
+    /* Completed first: every batch of a request is pushed before its completion, so taking the
+     * batches second means none are left behind for a request that is about to be freed */
+    StackNode *node = stack_pop_all(&queue->completed);
+    stream_batches_deliver(stack_pop_all(&queue->streamed));
+    while(node != NULL) {
+        AcRequestData *rd = container_of(node, AcRequestData, completed);
+        node = node->next;
+        REQUEST_TRACE_PRINT("CompletionQueue_complete", rd);
+        DEBUG_PRINT("completed AcRequestData; address=%p", rd);
+        session_in_flight_remove(rd->session, rd);
+        if(rd->cancelled) {
+            buffer_release_received(rd->session, &rd->header_buffer);
+            buffer_release_received(rd->session, &rd->body_buffer);
+            Py_DECREF(rd->session);
+            PyObject *rtn = PyObject_CallMethodObjArgs(rd->future, str_cancel, NULL);
+            if(rtn == NULL) {
+                PyErr_WriteUnraisable(rd->future);
+            }
+            Py_XDECREF(rtn);
+        }
+        else if(rd->result == CURLE_OK) {
+            Response *response = response_alloc();
+            response->header_buffer = rd->header_buffer;
+            response->body_buffer = rd->body_buffer;
+            response->body = NULL;
+            response->exports = 0;
+            response->body_flags = rd->body_flags;
+            response->body_length = rd->body_length;
+            response->checksum = rd->checksum;
+            response->info = rd->info;
+            memset(&rd->info, 0, sizeof(rd->info));
+            response->session = rd->session;
+            response->redirects = rd->redirects;
+            response->redirects_len = rd->redirects_len;
+            rd->redirects = NULL;
+            rd->redirects_len = 0;
+            resolve_future(rd->future, str_set_result, (PyObject*)response);
+            Py_DECREF(response);
+        }
+        else {
+            PyObject *error;
+            if(rd->sink_overflow) {
+                error = PyObject_CallFunction(RequestError, "s", "response body is larger than the sink");
+            }
+            else if(rd->sink_errno != 0) {
+                error = PyObject_CallFunction(RequestError, "ss", "writing to the sink failed", strerror(rd->sink_errno));
+            }
+            else if(rd->upload_errno != 0) {
+                error = PyObject_CallFunction(RequestError, "ss", "reading the request body failed", strerror(rd->upload_errno));
+            }
+            else if(rd->redirect_error != NULL) {
+                error = PyObject_CallFunction(RequestError, "s", rd->redirect_error);
+            }
+            else if(rd->timeout_phase != NULL) {
+                error = PyObject_CallFunction(RequestTimeout, "s", curl_easy_strerror(rd->result));
+                if(error != NULL) {
+                    PyObject *phase = PyUnicode_InternFromString(rd->timeout_phase);
+                    PyObject_SetAttrString(error, "phase", phase);
+                    Py_XDECREF(phase);
+                }
+            }
+            else {
+                error = PyObject_CallFunction(RequestError, "s", curl_easy_strerror(rd->result));
+            }
+            buffer_release_received(rd->session, &rd->header_buffer);
+            buffer_release_received(rd->session, &rd->body_buffer);
+            Py_DECREF(rd->session);
+            resolve_future(rd->future, str_set_exception, error);
+            Py_XDECREF(error);
+        }
+        Py_DECREF(rd->future);
+        if(rd->req_data.obj != NULL) {
+            PyBuffer_Release(&rd->req_data);
+        }
+        Py_XDECREF(rd->stream);
+        if(rd->sink_view.obj != NULL) {
+            PyBuffer_Release(&rd->sink_view);
+        }
+        if(rd->upload == UPLOAD_CHUNKS) {
+            upload_chunks_free(rd);
+            Py_DECREF(rd->upload_feeder);
+        }
+        redirect_hops_free(rd->redirects, rd->redirects_len);
+        transfer_info_free(&rd->info);
+        request_data_release(rd);
+    }
+    EXIT();
+}
+
+/* Called by the asyncio loop when the queue's fd is readable */
+
+static PyObject *
+CompletionQueue_complete(PyObject *self, PyObject *args)
+{
+    ENTER();
+    CompletionQueue *queue = (CompletionQueue*)self;
+    doorbell_clear(&queue->doorbell);
+    completion_queue_drain(queue);
+    Py_INCREF(Py_None);
+    EXIT();
+    return Py_None;
+}
+
+
+static PyMethodDef CompletionQueue_methods[] = {
+    {"fileno", CompletionQueue_fileno, METH_NOARGS, "Get the file descriptor that becomes readable when requests complete"},
+    {"complete", CompletionQueue_complete, METH_NOARGS, "Resolve the futures of completed requests"},
     {NULL, NULL, 0, NULL}
 };
 
 
-static PyMemberDef Response_members[] = {
-    {NULL}
-};
+static PyTypeObject CompletionQueueType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_acurl.CompletionQueue",  /* tp_name */
+    sizeof(CompletionQueue),   /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)CompletionQueue_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_reserved */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash  */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,        /* tp_flags */
+    "Completion Queue Type",   /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    CompletionQueue_methods,   /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    CompletionQueue_new,       /* tp_new */
+};
+
+/* Queue a finished request for the Python side, the doorbell is only written for the first
+ * completion since the Python side last drained. Driven from asyncio the queue is drained by
+ * whoever called into curl, so there is no doorbell */
+
+static inline void complete_request(EventLoop *loop, AcRequestData *rd)
+{
+    __atomic_add_fetch(&loop->handed_bytes, (long long)(rd->header_buffer.len + rd->body_buffer.len), __ATOMIC_SEQ_CST);
+    stack_push(&loop->completions->completed, &rd->completed);
+    if(loop->asyncio_loop == NULL) {
+        doorbell_ring(&loop->completions->doorbell);
+    }
+}
+
+/* Free what curl needed only while sending the request. The body is a Python buffer, released
+ * with the GIL when the request is completed */
+
+static void release_request_buffers(AcRequestData *rd)
+{
+    request_lines_free(rd, rd->headers);
+    rd->headers = NULL;
+}
+
+static void easy_handle_put(EventLoop *loop, EasyHandle *handle);
+
+/* Take what the Response reports from a finished transfer and give its handle back to the pool
+ * right away, rather than when the Response is deallocated. Loop thread only */
+
+static void request_handle_release(EventLoop *loop, AcRequestData *rd)
+{
+    if(rd->result == CURLE_OK) {
+        TransferInfo *info = &rd->info;
+        CURL *curl = rd->curl;
+        char *effective_url = NULL, *redirect_url = NULL, *primary_ip = NULL;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &info->status);
+        curl_easy_getinfo(curl, CURLINFO_REDIRECT_COUNT, &info->redirect_count);
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &info->num_connects);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &info->total_time);
+        curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &info->namelookup_time);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &info->connect_time);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &info->appconnect_time);
+        curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &info->pretransfer_time);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &info->starttransfer_time);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &info->size_upload);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &info->size_download);
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &info->content_length);
+        curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective_url);
+        curl_easy_getinfo(curl, CURLINFO_REDIRECT_URL, &redirect_url);
+        curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &primary_ip);
+        /* Both URLs in one allocation, freed through effective_url */
+        size_t effective_size = strlen(effective_url != NULL ? effective_url : "") + 1;
+        size_t redirect_size = redirect_url != NULL ? strlen(redirect_url) + 1 : 0;
+        info->effective_url = (char *)malloc(effective_size + redirect_size);
+        memcpy(info->effective_url, effective_url != NULL ? effective_url : "", effective_size);
+        if(redirect_url != NULL) {
+            info->redirect_url = (char *)memcpy(info->effective_url + effective_size, redirect_url, redirect_size);
+        }
+        snprintf(info->primary_ip, sizeof(info->primary_ip), "%s", primary_ip != NULL ? primary_ip : "");
+    }
+    easy_handle_put(loop, rd->handle);
+    rd->handle = NULL;
+    rd->curl = NULL;
+}
+
+/* curl reports every timeout as CURLE_OPERATION_TIMEDOUT, work out which one expired from how
+ * far the transfer got: not connected yet (connect and TLS handshake, pretransfer time still
+ * 0) is the connect timeout, the whole deadline used up is the deadline, otherwise it stalled */
+
+static const char *timeout_phase(AcRequestData *rd)
+{
+    curl_off_t pretransfer = 0, total = 0;
+    curl_easy_getinfo(rd->curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(rd->curl, CURLINFO_TOTAL_TIME_T, &total);
+    if(rd->connect_timeout_ms > 0 && pretransfer == 0 &&
+       (rd->timeout_ms == 0 || rd->connect_timeout_ms <= rd->timeout_ms)) {
+        return "connect";
+    }
+    if(rd->timeout_ms > 0 && total / 1000 >= rd->timeout_ms) {
+        return "deadline";
+    }
+    if(rd->stall_timeout_ms > 0) {
+        return "stall";
+    }
+    return pretransfer == 0 ? "connect" : "deadline";
+}
+
+/* Write what has been batched up for a file descriptor sink */
+
+static bool sink_flush(AcRequestData *rd)
+{
+    const char *data = rd->body_buffer.block != NULL ? rd->body_buffer.block->data : NULL;
+    size_t len = rd->body_buffer.len;
+    while(len > 0) {
+        ssize_t written;
+        if(rd->sink_offset >= 0) {
+            written = pwrite(rd->sink_fd, data, len, rd->sink_offset + rd->sink_written);
+        }
+        else {
+            written = write(rd->sink_fd, data, len);
+        }
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            rd->sink_errno = errno;
+            return false;
+        }
+        data += written;
+        len -= written;
+        rd->sink_written += written;
+    }
+    rd->body_buffer.len = 0;
+    return true;
+}
+
+static size_t sink_write(AcRequestData *rd, char *ptr, size_t len)
+{
+    if(rd->sink == SINK_BUFFER) {
+        if(rd->sink_written + (long long)len > (long long)rd->sink_view.len) {
+            rd->sink_overflow = true;
+            return 0;
+        }
+        memcpy((char *)rd->sink_view.buf + rd->sink_written, ptr, len);
+        rd->sink_written += len;
+        return len;
+    }
+    if(rd->sink_preallocate && rd->sink_written == 0 && rd->body_buffer.len == 0 && rd->sink_offset >= 0) {
+        curl_off_t content_length = -1;
+        curl_easy_getinfo(rd->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+        if(content_length > 0) {
+            posix_fallocate(rd->sink_fd, rd->sink_offset, content_length); /* only a hint */
+        }
+    }
+    if(rd->body_buffer.len + len > SINK_BATCH_SIZE && !sink_flush(rd)) {
+        return 0;
+    }
+    if(unlikely(!buffer_append(rd->session->loop, &rd->body_buffer, ptr, len))) {
+        return 0;
+    }
+    return len;
+}
+
+/* Streamed requests: body_callback collects what curl writes into the request's body buffer and
+ * puts the request on the loop's dirty list, after each run of curl stream_flush hands every
+ * dirty buffer over in one batch. Data handed over but not read yet is counted in
+ * stream_unconsumed, when writing more would go over the high water mark body_callback pauses
+ * the transfer. Reading it back down to half the mark resumes it, either here when flushing or
+ * through Session.consumed. Loop thread only */
+
+static inline void stream_mark_dirty(EventLoop *loop, AcRequestData *rd)
+{
+    if(!rd->stream_dirty) {
+        rd->stream_dirty = true;
+        rd->stream_dirty_next = loop->dirty_streams;
+        loop->dirty_streams = rd;
+    }
+}
+
+static void stream_unlink_dirty(EventLoop *loop, AcRequestData *rd)
+{
+    if(!rd->stream_dirty) {
+        return;
+    }
+    for(AcRequestData **link = &loop->dirty_streams; *link != NULL; link = &(*link)->stream_dirty_next) {
+        if(*link == rd) {
+            *link = rd->stream_dirty_next;
+            break;
+        }
+    }
+    rd->stream_dirty = false;
+}
+
+static void stream_hand_over(EventLoop *loop, AcRequestData *rd)
+{
+    bool headers = rd->stream_headers_ready && !rd->stream_headers_sent;
+    if(!headers && rd->body_buffer.len == 0) {
+        return;
+    }
+    StreamBatch *batch = (StreamBatch *)malloc(sizeof(StreamBatch));
+    batch->rd = rd;
+    batch->status = -1;
+    batch->header.block = NULL;
+    batch->header.len = 0;
+    batch->upload_drained = false;
+    if(headers) {
+        batch->status = 0;
+        curl_easy_getinfo(rd->curl, CURLINFO_RESPONSE_CODE, &batch->status);
+        batch->header = rd->header_buffer;
+        rd->header_buffer.block = NULL;
+        rd->header_buffer.len = 0;
+        rd->stream_headers_sent = true;
+    }
+    batch->data = rd->body_buffer;
+    rd->body_buffer.block = NULL;
+    rd->body_buffer.len = 0;
+    __atomic_add_fetch(&rd->stream_unconsumed, (long long)batch->data.len, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&loop->handed_bytes, (long long)(batch->header.len + batch->data.len), __ATOMIC_SEQ_CST);
+    stack_push(&loop->completions->streamed, &batch->node);
+    if(loop->asyncio_loop == NULL) {
+        doorbell_ring(&loop->completions->doorbell);
+    }
+}
 
+static inline bool stream_can_resume(AcRequestData *rd)
+{
+    return __atomic_load_n(&rd->stream_unconsumed, __ATOMIC_SEQ_CST) <= rd->stream_high_water / 2;
+}
 
-static PyTypeObject ResponseType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "_acurl.Response",           /* tp_name */
-    sizeof(Response),           /* tp_basicsize */
-    0,                         /* tp_itemsize */
-    (destructor)Response_dealloc,           /* tp_dealloc */
-    0,                         /* tp_print */
-    0,                         /* tp_getattr */
-    0,                         /* tp_setattr */
-    0,                         /* tp_reserved */
-    0,                         /* tp_repr */
-    0,                         /* tp_as_number */
-    0,                         /* tp_as_sequence */
-    0,                         /* tp_as_mapping */
-    0,                         /* tp_hash  */
-    0,                         /* tp_call */
-    0,                         /* tp_str */
-    0,                         /* tp_getattro */
-    0,                         /* tp_setattro */
-    0,                         /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,        /* tp_flags */
-    "Response Type",           /* tp_doc */
-    0,                         /* tp_traverse */
-    0,                         /* tp_clear */
-    0,                         /* tp_richcompare */
-    0,                         /* tp_weaklistoffset */
-    0,                         /* tp_iter */
-    0,                         /* tp_iternext */
-    Response_methods,          /* tp_methods */
-    Response_members,          /* tp_members */
-    0,                         /* tp_getset */
-    0,                         /* tp_base */
-    0,                         /* tp_dict */
-    0,                         /* tp_descr_get */
-    0,                         /* tp_descr_set */
-    0,                         /* tp_dictoffset */
-    0,                         /* tp_init */
-    0,                         /* tp_alloc */
-    0,                         /* tp_new */
-};
+/* Unpausing runs body_callback with what curl held back, so it may put rd on the dirty list.
+ * It unpauses both directions, a side that still can't go on pauses itself again */
+
+static void stream_resume(EventLoop *loop, AcRequestData *rd)
+{
+    if(rd->state != REQUEST_RUNNING) {
+        return;
+    }
+    int paused = __atomic_exchange_n(&rd->stream_paused, 0, __ATOMIC_SEQ_CST);
+    paused |= __atomic_exchange_n(&rd->upload_paused, 0, __ATOMIC_SEQ_CST);
+    if(paused) {
+        curl_easy_pause(rd->curl, CURLPAUSE_CONT);
+    }
+}
+
+static void stream_flush(EventLoop *loop)
+{
+    while(loop->dirty_streams != NULL) {
+        AcRequestData *rd = loop->dirty_streams;
+        loop->dirty_streams = NULL;
+        while(rd != NULL) {
+            AcRequestData *next = rd->stream_dirty_next;
+            rd->stream_dirty = false;
+            stream_hand_over(loop, rd);
+            /* The reader may have caught up between the pause and Session.consumed seeing it */
+            if(__atomic_load_n(&rd->stream_paused, __ATOMIC_SEQ_CST) && stream_can_resume(rd)) {
+                stream_resume(loop, rd);
+            }
+            rd = next;
+        }
+    }
+}
+
+/* Pause a transfer for the memory budget, unless every other one is already paused and the
+ * transfers' own data is what fills it, then one request keeps going so it can complete. Loop
+ * thread only */
+
+static bool budget_pause(EventLoop *loop, AcRequestData *rd)
+{
+    if(!rd->budget_paused && loop->budget_paused_len + 1 >= loop->requests_in_flight && !budget_held_by_python(loop)) {
+        return false;
+    }
+    if(!budget_block(loop)) {
+        return false;
+    }
+    if(!rd->budget_paused) {
+        rd->budget_paused = true;
+        rd->budget_next = loop->budget_paused;
+        loop->budget_paused = rd;
+        loop->budget_paused_len++;
+        loop->budget_pauses++;
+    }
+    return true;
+}
+
+static void budget_unlink_paused(EventLoop *loop, AcRequestData *rd)
+{
+    if(!rd->budget_paused) {
+        return;
+    }
+    for(AcRequestData **link = &loop->budget_paused; *link != NULL; link = &(*link)->budget_next) {
+        if(*link == rd) {
+            *link = rd->budget_next;
+            break;
+        }
+    }
+    rd->budget_paused = false;
+    loop->budget_paused_len--;
+}
+
+/* After requests finish, keep one transfer going when every other one is paused for the budget
+ * or waiting to start, the data they hold can't be released until they complete */
+
+static void start_queued_requests(EventLoop *loop);
+
+static void budget_keep_going(EventLoop *loop)
+{
+    if(budget_exceeded(loop) && budget_held_by_python(loop)) {
+        return;
+    }
+    if(loop->budget_paused != NULL && loop->budget_paused_len >= loop->requests_in_flight) {
+        AcRequestData *rd = loop->budget_paused;
+        loop->budget_paused = rd->budget_next;
+        loop->budget_paused_len--;
+        rd->budget_paused = false;
+        curl_easy_pause(rd->curl, CURLPAUSE_CONT);
+    }
+    else if(loop->budget_queued != NULL && loop->requests_in_flight == 0) {
+        start_queued_requests(loop);
+    }
+}
+
+/* Follow a 3xx response of a request made with max_redirects on the same handle, as
+ * Session._request does from Python: 301, 302 and 303 become a GET without a body, 307 and 308
+ * send the request again as it was. The redirect's own headers and body aren't kept, its
+ * status, URL and time go in the history. Returns false for the final response, or with
+ * rd->result set when the redirect can't be followed. Loop thread only */
+
+static bool redirect_follow(EventLoop *loop, AcRequestData *rd)
+{
+    long status = 0;
+    char *location = NULL, *url = NULL;
+    curl_off_t total_time = 0;
+    if(rd->max_redirects < 0 || rd->result != CURLE_OK || rd->cancelled || rd->stream != NULL) {
+        return false;
+    }
+    curl_easy_getinfo(rd->curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(rd->curl, CURLINFO_REDIRECT_URL, &location);
+    if(status < 300 || status >= 400 || location == NULL) {
+        return false;
+    }
+    bool get = status == 301 || status == 302 || status == 303;
+    if(rd->redirects_len == rd->max_redirects) {
+        rd->redirect_error = "Max Redirects";
+    }
+    else if(!get && rd->upload == UPLOAD_CHUNKS) {
+        rd->redirect_error = "can't send a body from an async iterator again to follow a redirect";
+    }
+    else if(!get && rd->upload == UPLOAD_FD && rd->upload_offset < 0) {
+        rd->redirect_error = "can't read a body from a pipe again to follow a redirect";
+    }
+    if(rd->redirect_error != NULL) {
+        rd->result = CURLE_TOO_MANY_REDIRECTS;
+        return false;
+    }
+    curl_easy_getinfo(rd->curl, CURLINFO_EFFECTIVE_URL, &url);
+    curl_easy_getinfo(rd->curl, CURLINFO_TOTAL_TIME_T, &total_time);
+    rd->redirect_elapsed += total_time;
+    long timeout_ms = 0;
+    if(rd->timeout_ms > 0) {
+        /* The deadline covers every hop */
+        timeout_ms = rd->timeout_ms - (long)(rd->redirect_elapsed / 1000);
+        if(timeout_ms <= 0) {
+            rd->result = CURLE_OPERATION_TIMEDOUT;
+            rd->timeout_phase = "deadline";
+            return false;
+        }
+    }
+    if(rd->redirects_len % 4 == 0) {
+        rd->redirects = (RedirectHop *)realloc(rd->redirects, (rd->redirects_len + 4) * sizeof(RedirectHop));
+    }
+    RedirectHop *hop = &rd->redirects[rd->redirects_len++];
+    hop->status = status;
+    hop->total_time = total_time;
+    hop->url = strdup(url != NULL ? url : "");
+    buffered_drop(rd->session, (long long)(rd->header_buffer.len + rd->body_buffer.len));
+    rd->header_buffer.len = 0;
+    rd->body_buffer.len = 0;
+    rd->body_length = 0;
+    rd->checksum = 1;
+    rd->sink = rd->requested_sink;
+    rd->body_flags = rd->requested_body_flags;
+    /* curl keeps the redirect URL apart from the URL option, setting one doesn't free the other */
+    curl_easy_setopt(rd->curl, CURLOPT_URL, location);
+    if(get) {
+        curl_easy_setopt(rd->curl, CURLOPT_CUSTOMREQUEST, NULL);
+        curl_easy_setopt(rd->curl, CURLOPT_HTTPGET, 1L);
+    }
+    else if(rd->upload == UPLOAD_FD) {
+        rd->upload_sent = 0;
+    }
+    curl_easy_setopt(rd->curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+    REQUEST_TRACE_PRINT("redirect_follow", rd);
+    curl_multi_add_handle(loop->multi, rd->curl);
+    return true;
+}
 
 /* When at least one request has completed, write completed responses onto completion queue*/
 
-void response_complete(EventLoop *loop) 
+void response_complete(EventLoop *loop) 
+{
+    ENTER();
+    DEBUG_PRINT("loop=%p", loop);
+    int remaining_in_queue = 1;
+    AcRequestData *rd;
+    CURLMsg *msg;
+    stream_flush(loop);
+    while(remaining_in_queue > 0) 
+    {
+        DEBUG_PRINT("calling curl_multi_info_read");
+        msg = curl_multi_info_read(loop->multi, &remaining_in_queue);
+        if(msg == NULL) {
+            break;
+        }
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (void **)&rd);
+        curl_multi_remove_handle(loop->multi, rd->curl);
+        rd->result = msg->data.result;
+        if(rd->result == CURLE_OPERATION_TIMEDOUT) {
+            rd->timeout_phase = timeout_phase(rd);
+        }
+        if(redirect_follow(loop, rd)) {
+            continue;
+        }
+        if(rd->sink == SINK_FD) {
+            if(!sink_flush(rd) && rd->result == CURLE_OK) {
+                rd->result = CURLE_WRITE_ERROR;
+            }
+            if(rd->sink_offset >= 0) {
+                /* Leave the fd's offset after the body, as if it had been written with write() */
+                lseek(rd->sink_fd, rd->sink_offset + rd->sink_written, SEEK_SET);
+            }
+            rd->body_buffer.len = 0; /* batched for the fd, never counted as buffered */
+        }
+        budget_unlink_paused(loop, rd);
+        release_request_buffers(rd);
+        if(rd->stream != NULL) {
+            /* Whatever arrived last goes ahead of the completion, headers only if there are some */
+            stream_unlink_dirty(loop, rd);
+            rd->stream_headers_ready |= rd->result == CURLE_OK;
+            stream_hand_over(loop, rd);
+        }
+        request_handle_release(loop, rd);
+        rd->state = REQUEST_DONE;
+        loop->requests_in_flight--;
+
+        REQUEST_TRACE_PRINT("response_complete", rd);
+        complete_request(loop, rd);
+        budget_keep_going(loop);
+    }
+    EXIT();
+}
+
+
+void socket_action_and_response_complete(EventLoop *loop, curl_socket_t socket, int ev_bitmask) 
+{
+    ENTER();
+    DEBUG_PRINT("loop=%p socket=%d ev_bitmask=%d", loop, socket, ev_bitmask);
+    int running_handles;
+    curl_multi_socket_action(loop->multi, socket, ev_bitmask, &running_handles);
+    DEBUG_PRINT("after running_handlesr=%d", running_handles);
+    response_complete(loop);
+    EXIT();
+}
+
+/* See docs for CURLOPT_HEADERFUNCTION */
+
+static size_t header_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    ENTER();
+    AcRequestData *rd = (AcRequestData *)userdata;
+    size_t len = size * nmemb;
+    if(rd->body_flags & REQUEST_DISCARD_HEADERS) {
+        EXIT();
+        return len;
+    }
+    if(unlikely(!buffer_append(rd->session->loop, &rd->header_buffer, ptr, len))) {
+        EXIT();
+        return 0; /* fails the transfer */
+    }
+    buffered_add(rd->session, (long long)len);
+    if(rd->stream != NULL && !rd->stream_headers_ready && len == 2 && ptr[0] == '\r' && ptr[1] == '\n') {
+        long status = 0;
+        curl_easy_getinfo(rd->curl, CURLINFO_RESPONSE_CODE, &status);
+        if(status >= 200) {
+            rd->stream_headers_ready = true;
+            stream_mark_dirty(rd->session->loop, rd);
+        }
+        else {
+            /* An interim 1xx response */
+            buffered_drop(rd->session, (long long)rd->header_buffer.len);
+            rd->header_buffer.len = 0;
+        }
+    }
+    EXIT();
+    return len;
+}
+
+/* See docs for CURLOPT_WTIE_FUNCTION */
+
+/* Adler-32, as zlib computes it, so a discarded body can still be checked against a known one */
+
+#define ADLER32_BASE 65521
+#define ADLER32_NMAX 5552 /* most bytes before the sums have to be reduced to fit 32 bits */
+
+static uint32_t adler32_update(uint32_t adler, const unsigned char *data, size_t len)
+{
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while(len > 0) {
+        size_t n = len < ADLER32_NMAX ? len : ADLER32_NMAX;
+        len -= n;
+        while(n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER32_BASE;
+        b %= ADLER32_BASE;
+    }
+    return (b << 16) | a;
+}
+
+size_t body_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    ENTER();
+    AcRequestData *rd = (AcRequestData *)userdata;
+    EventLoop *loop = rd->session->loop;
+    size_t len = size * nmemb;
+    if(rd->stream != NULL) {
+        long long pending = (long long)rd->body_buffer.len + __atomic_load_n(&rd->stream_unconsumed, __ATOMIC_SEQ_CST);
+        stream_mark_dirty(loop, rd);
+        if(pending > 0 && pending + (long long)len > rd->stream_high_water) {
+            __atomic_store_n(&rd->stream_paused, 1, __ATOMIC_SEQ_CST);
+            EXIT();
+            return CURL_WRITEFUNC_PAUSE;
+        }
+    }
+    if(rd->sink != SINK_NONE && rd->body_length == 0) {
+        /* The body of a redirect isn't the download */
+        long status = 0;
+        curl_easy_getinfo(rd->curl, CURLINFO_RESPONSE_CODE, &status);
+        if(status >= 300 && status < 400) {
+            rd->sink = SINK_NONE;
+            rd->body_flags |= REQUEST_DISCARD_BODY;
+        }
+    }
+    if(rd->sink == SINK_NONE && !(rd->body_flags & REQUEST_DISCARD_BODY) && budget_exceeded(loop) &&
+       budget_pause(loop, rd)) {
+        EXIT();
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    rd->body_length += len;
+    if(rd->body_flags & REQUEST_CHECKSUM) {
+        rd->checksum = adler32_update(rd->checksum, (const unsigned char *)ptr, len);
+    }
+    if(rd->sink != SINK_NONE) {
+        len = sink_write(rd, ptr, len);
+        EXIT();
+        return len;
+    }
+    if(rd->body_flags & REQUEST_DISCARD_BODY) {
+        EXIT();
+        return len;
+    }
+    if(unlikely(rd->body_buffer.block == NULL) && rd->stream == NULL) {
+        /* Size the buffer for the whole body up front when the server said how big it is */
+        curl_off_t content_length = -1;
+        curl_easy_getinfo(rd->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+        if(content_length > (curl_off_t)len && content_length <= BUFFER_PRESIZE_MAX) {
+            buffer_reserve(loop, &rd->body_buffer, (size_t)content_length);
+        }
+    }
+    if(unlikely(!buffer_append(loop, &rd->body_buffer, ptr, len))) {
+        EXIT();
+        return 0; /* fails the transfer */
+    }
+    buffered_add(rd->session, (long long)len);
+    EXIT();
+    return len;
+}
+
+/* Request bodies read through CURLOPT_READFUNCTION. A file is read straight into curl's buffer.
+ * Chunks from the Python side are copied out of the queue and freed as they are used up, once
+ * the queue is back down to half the high water mark a waiting feeder is told to push more.
+ * With the queue empty and more to come the transfer pauses until Session.upload resumes it */
+
+static void upload_collect(AcRequestData *rd)
+{
+    StackNode *node = stack_pop_all(&rd->upload_pushed);
+    if(node == NULL) {
+        return;
+    }
+    if(rd->upload_head == NULL) {
+        rd->upload_head = node;
+    }
+    else {
+        rd->upload_tail->next = node;
+    }
+    while(node->next != NULL) {
+        node = node->next;
+    }
+    rd->upload_tail = node;
+}
+
+static size_t upload_copy(AcRequestData *rd, char *buffer, size_t len)
+{
+    size_t copied = 0;
+    upload_collect(rd);
+    while(copied < len && rd->upload_head != NULL) {
+        UploadChunk *chunk = container_of(rd->upload_head, UploadChunk, node);
+        size_t n = chunk->len - rd->upload_head_offset;
+        if(n > len - copied) {
+            n = len - copied;
+        }
+        memcpy(buffer + copied, chunk->data + rd->upload_head_offset, n);
+        copied += n;
+        rd->upload_head_offset += n;
+        if(rd->upload_head_offset == chunk->len) {
+            rd->upload_head = chunk->node.next;
+            rd->upload_head_offset = 0;
+            free(chunk);
+        }
+    }
+    if(copied == 0) {
+        return 0;
+    }
+    long long queued = __atomic_sub_fetch(&rd->upload_queued, (long long)copied, __ATOMIC_SEQ_CST);
+    if(queued <= UPLOAD_HIGH_WATER / 2 && __atomic_load_n(&rd->upload_waiting, __ATOMIC_SEQ_CST) &&
+       __atomic_exchange_n(&rd->upload_waiting, 0, __ATOMIC_SEQ_CST)) {
+        EventLoop *loop = rd->session->loop;
+        StreamBatch *batch = (StreamBatch *)calloc(1, sizeof(StreamBatch));
+        batch->rd = rd;
+        batch->status = -1;
+        batch->upload_drained = true;
+        stack_push(&loop->completions->streamed, &batch->node);
+        if(loop->asyncio_loop == NULL) {
+            doorbell_ring(&loop->completions->doorbell);
+        }
+    }
+    return copied;
+}
+
+static size_t upload_callback(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+    ENTER();
+    AcRequestData *rd = (AcRequestData *)userdata;
+    size_t len = size * nitems;
+    if(rd->upload == UPLOAD_FD) {
+        ssize_t n;
+        do {
+            if(rd->upload_offset >= 0) {
+                n = pread(rd->upload_fd, buffer, len, rd->upload_offset + rd->upload_sent);
+            }
+            else {
+                n = read(rd->upload_fd, buffer, len);
+            }
+        } while(n < 0 && errno == EINTR);
+        if(n < 0) {
+            rd->upload_errno = errno;
+            EXIT();
+            return CURL_READFUNC_ABORT;
+        }
+        rd->upload_sent += n;
+        EXIT();
+        return (size_t)n;
+    }
+    if(rd->upload != UPLOAD_CHUNKS) {
+        EXIT();
+        return 0;
+    }
+    size_t copied = upload_copy(rd, buffer, len);
+    if(copied == 0 && !__atomic_load_n(&rd->upload_eof, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&rd->upload_paused, 1, __ATOMIC_SEQ_CST);
+        /* Session.upload may have pushed between the copy and the pause without seeing it */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        copied = upload_copy(rd, buffer, len);
+        if(copied == 0 && !__atomic_load_n(&rd->upload_eof, __ATOMIC_ACQUIRE)) {
+            EXIT();
+            return CURL_READFUNC_PAUSE;
+        }
+        __atomic_store_n(&rd->upload_paused, 0, __ATOMIC_SEQ_CST);
+    }
+    if(copied == 0) {
+        /* Chunks pushed just before the end */
+        copied = upload_copy(rd, buffer, len);
+    }
+    rd->upload_sent += copied;
+    EXIT();
+    return copied;
+}
+
+/* curl rewinds the body to send it again on a new connection, only possible for a file */
+
+static int upload_seek_callback(void *userdata, curl_off_t offset, int origin)
+{
+    AcRequestData *rd = (AcRequestData *)userdata;
+    if(rd->upload == UPLOAD_FD && rd->upload_offset >= 0 && origin == SEEK_SET) {
+        rd->upload_sent = offset;
+        return CURL_SEEKFUNC_OK;
+    }
+    return CURL_SEEKFUNC_CANTSEEK;
+}
+
+
+/* Counting allocators handed to curl_global_init_mem, so the memory held by handles and their
+ * connections and caches can be reported. Each block is prefixed with its size */
+
+#define CURL_MEMORY_HEADER 16 /* keeps the malloc alignment */
+
+static void *curl_memory_malloc(size_t size)
+{
+    char *block = malloc(CURL_MEMORY_HEADER + size);
+    if(block == NULL) {
+        return NULL;
+    }
+    *(size_t *)block = size;
+    __atomic_add_fetch(&curl_memory, (long long)size, __ATOMIC_RELAXED);
+    return block + CURL_MEMORY_HEADER;
+}
+
+static void curl_memory_free(void *ptr)
+{
+    if(ptr != NULL) {
+        char *block = (char *)ptr - CURL_MEMORY_HEADER;
+        __atomic_sub_fetch(&curl_memory, (long long)*(size_t *)block, __ATOMIC_RELAXED);
+        free(block);
+    }
+}
+
+static void *curl_memory_realloc(void *ptr, size_t size)
+{
+    if(ptr == NULL) {
+        return curl_memory_malloc(size);
+    }
+    char *block = (char *)ptr - CURL_MEMORY_HEADER;
+    size_t old_size = *(size_t *)block;
+    block = realloc(block, CURL_MEMORY_HEADER + size);
+    if(block == NULL) {
+        return NULL;
+    }
+    *(size_t *)block = size;
+    __atomic_add_fetch(&curl_memory, (long long)size - (long long)old_size, __ATOMIC_RELAXED);
+    return block + CURL_MEMORY_HEADER;
+}
+
+static char *curl_memory_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = curl_memory_malloc(len);
+    if(copy != NULL) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+static void *curl_memory_calloc(size_t nmemb, size_t size)
 {
-    ENTER();
-    DEBUG_PRINT("loop=%p", loop);
-    int remaining_in_queue = 1;
-    AcRequestData *rd;
-    CURLMsg *msg;
-    while(remaining_in_queue > 0) 
-    {
-        DEBUG_PRINT("calling curl_multi_info_read");
-        msg = curl_multi_info_read(loop->multi, &remaining_in_queue);
-        if(msg == NULL) {
-            break;
-        }
-        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (void **)&rd);
-        curl_multi_remove_handle(loop->multi, rd->curl);
-        rd->result = msg->data.result;
-        curl_slist_free_all(rd->headers);
-        rd->headers = NULL;
-        free(rd->req_data_buf);
-        rd->req_data_buf = NULL;
-        rd->req_data_len = 0;
-
-        DEBUG_PRINT("writing to req_out_write");
-        REQUEST_TRACE_PRINT("response_complete", rd);
-        write(loop->req_out_write, &rd, sizeof(AcRequestData *));
+    if(size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
     }
-    EXIT();
+    void *ptr = curl_memory_malloc(nmemb * size);
+    if(ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
 }
 
 
-void socket_action_and_response_complete(EventLoop *loop, curl_socket_t socket, int ev_bitmask) 
+static void easy_handle_destroy(EventLoop *loop, EasyHandle *handle)
 {
-    ENTER();
-    DEBUG_PRINT("loop=%p socket=%d ev_bitmask=%d", loop, socket, ev_bitmask);
-    int running_handles;
-    curl_multi_socket_action(loop->multi, socket, ev_bitmask, &running_handles);
-    DEBUG_PRINT("after running_handlesr=%d", running_handles);
-    response_complete(loop);
-    EXIT();
+    curl_easy_cleanup(handle->curl);
+    free(handle);
+    loop->handles_live--;
 }
 
-/* See docs for CURLOPT_HEADERFUNCTION */
+/* Back onto the free list when a request is done with it, destroyed beyond
+ * EASY_HANDLE_POOL_MAX. Loop thread only */
 
-static size_t header_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
-    ENTER();
-    AcRequestData *rd = (AcRequestData *)userdata;
-    struct BufferNode *node = (struct BufferNode *)malloc(sizeof(struct BufferNode));
-    node->len = size * nmemb;
-    node->buffer = (char*)malloc(node->len);
-    memcpy(node->buffer, ptr, node->len);
-    node->next = NULL;
-    if(unlikely(rd->header_buffer_head == NULL)) {
-        rd->header_buffer_head = node;
+static void easy_handle_put(EventLoop *loop, EasyHandle *handle)
+{
+    if(loop->free_handles_len < EASY_HANDLE_POOL_MAX) {
+        handle->node.next = loop->free_handles;
+        loop->free_handles = &handle->node;
+        loop->free_handles_len++;
     }
-    if(likely(rd->header_buffer_tail != NULL)) {
-        rd->header_buffer_tail->next = node;
+    else {
+        easy_handle_destroy(loop, handle);
     }
-    rd->header_buffer_tail = node;
-    EXIT();
-    return node->len;
 }
 
-/* See docs for CURLOPT_WTIE_FUNCTION */
+/* Take a handle from the pool, or create one, NULL if that fails. Loop thread only */
 
-size_t body_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
-    ENTER();
-    AcRequestData *rd = (AcRequestData *)userdata;
-    struct BufferNode *node = (struct BufferNode *)malloc(sizeof(struct BufferNode));
-    node->len = size * nmemb;
-    node->buffer = (char*)malloc(node->len);
-    memcpy(node->buffer, ptr, node->len);
-    node->next = NULL;
-    if(unlikely(rd->body_buffer_head == NULL)) {
-        rd->body_buffer_head = node;
+static EasyHandle *easy_handle_get(EventLoop *loop)
+{
+    if(loop->free_handles != NULL) {
+        EasyHandle *handle = container_of(loop->free_handles, EasyHandle, node);
+        loop->free_handles = handle->node.next;
+        loop->free_handles_len--;
+        loop->handle_pool_hits++;
+        return handle;
     }
-    if(likely(rd->body_buffer_tail != NULL)) {
-        rd->body_buffer_tail->next = node;
+    EasyHandle *handle = (EasyHandle *)malloc(sizeof(EasyHandle));
+    if(handle == NULL || (handle->curl = curl_easy_init()) == NULL) {
+        free(handle);
+        return NULL;
+    }
+    handle->shared = NULL;
+    //curl_easy_setopt(handle->curl, CURLOPT_VERBOSE, 1L); //DEBUG
+    curl_easy_setopt(handle->curl, CURLOPT_ENCODING, "");
+    curl_easy_setopt(handle->curl, CURLOPT_COOKIEFILE, "");
+    curl_easy_setopt(handle->curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(handle->curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt(handle->curl, CURLOPT_WRITEFUNCTION, body_callback);
+    curl_easy_setopt(handle->curl, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(handle->curl, CURLOPT_READFUNCTION, upload_callback);
+    curl_easy_setopt(handle->curl, CURLOPT_SEEKFUNCTION, upload_seek_callback);
+    loop->handle_pool_misses++;
+    loop->handles_live++;
+    return handle;
+}
+
+/* Clean up the shares of deallocated sessions. Every handle that was attached to one went back
+ * to the free list when its request finished, before the session could go, so detach the idle
+ * ones first. Loop thread only */
+
+static void cleanup_retired_shares(EventLoop *loop)
+{
+    StackNode *retired = stack_pop_all(&loop->retired_shares);
+    if(retired == NULL) {
+        return;
+    }
+    while(retired != NULL) {
+        Share *share = container_of(retired, Share, node);
+        retired = retired->next;
+        for(StackNode *node = loop->free_handles; node != NULL; node = node->next) {
+            EasyHandle *handle = container_of(node, EasyHandle, node);
+            if(handle->shared == share->shared) {
+                curl_easy_setopt(handle->curl, CURLOPT_SHARE, NULL);
+                handle->shared = NULL;
+            }
+        }
+        curl_share_cleanup(share->shared);
+        free(share);
     }
-    rd->body_buffer_tail = node;
-    EXIT();
-    return node->len;
 }
 
 
-void start_request(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask)
+void start_request(EventLoop *loop, AcRequestData *rd)
 {
     ENTER();
-    AcRequestData *rd;
-    EventLoop *loop = (EventLoop*)clientData;
-    int b_read = read(loop->req_in_read, &rd, sizeof(AcRequestData *));
     REQUEST_TRACE_PRINT("start_request", rd);
-    DEBUG_PRINT("read AcRequestData");
-    rd->curl = curl_easy_init();
-    curl_easy_setopt(rd->curl, CURLOPT_SHARE, rd->session->shared);
+    if(!rd->cancelled && (rd->handle = easy_handle_get(loop)) == NULL) {
+        rd->result = CURLE_OUT_OF_MEMORY;
+    }
+    if(rd->handle == NULL) {
+        /* Cancelled before it got here or out of memory, completed without a transfer */
+        request_string_free(rd, rd->method);
+        rd->method = NULL;
+        request_string_free(rd, rd->url);
+        rd->url = NULL;
+        request_string_free(rd, rd->auth);
+        rd->auth = NULL;
+        request_lines_free(rd, rd->cookies);
+        rd->cookies = NULL;
+        release_request_buffers(rd);
+        rd->state = REQUEST_DONE;
+        complete_request(loop, rd);
+        EXIT();
+        return;
+    }
+    rd->curl = rd->handle->curl;
+    if(rd->handle->shared != rd->session->share->shared) {
+        curl_easy_setopt(rd->curl, CURLOPT_SHARE, rd->session->share->shared);
+        rd->handle->shared = rd->session->share->shared;
+    }
     curl_easy_setopt(rd->curl, CURLOPT_URL, rd->url);
     curl_easy_setopt(rd->curl, CURLOPT_CUSTOMREQUEST, rd->method);
-    //curl_easy_setopt(rd->curl, CURLOPT_VERBOSE, 1L); //DEBUG
-    curl_easy_setopt(rd->curl, CURLOPT_ENCODING, "");
-    if(rd->headers != NULL) {
-        curl_easy_setopt(rd->curl, CURLOPT_HTTPHEADER, rd->headers);
+    /* A recycled handle keeps the previous request's options, so these are always set */
+    curl_easy_setopt(rd->curl, CURLOPT_HTTPHEADER, rd->headers);
+    curl_easy_setopt(rd->curl, CURLOPT_USERPWD, rd->auth);
+    for(struct curl_slist *cookie = rd->cookies; cookie != NULL; cookie = cookie->next) {
+        DEBUG_PRINT("set cookie [%s]", cookie->data);
+        curl_easy_setopt(rd->curl, CURLOPT_COOKIELIST, cookie->data);
     }
-    if(rd->auth != NULL) {
-        curl_easy_setopt(rd->curl, CURLOPT_USERPWD, rd->auth);
+    if(rd->upload != UPLOAD_NONE) {
+        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDS, NULL); /* or curl sends those instead */
+        curl_easy_setopt(rd->curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)rd->upload_size);
     }
-    for(int i=0; i < rd->cookies_len; i++) {
-        DEBUG_PRINT("set cookie [%s]", rd->cookies_str[i]);
-        curl_easy_setopt(rd->curl, CURLOPT_COOKIELIST, rd->cookies_str[i]);
+    else if(rd->req_data_buf != NULL) {
+        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)rd->req_data_len);
+        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDS, rd->req_data_buf);
     }
-    if(rd->req_data_buf != NULL) {
-        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDSIZE, rd->req_data_len);
-        curl_easy_setopt(rd->curl, CURLOPT_POSTFIELDS, (char*)rd->req_data_buf);
+    else {
+        curl_easy_setopt(rd->curl, CURLOPT_HTTPGET, 1L); /* undo POSTFIELDS */
     }
-    curl_easy_setopt(rd->curl, CURLOPT_SSL_VERIFYPEER, 0L);
-    curl_easy_setopt(rd->curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt(rd->curl, CURLOPT_TIMEOUT_MS, rd->timeout_ms);
+    curl_easy_setopt(rd->curl, CURLOPT_CONNECTTIMEOUT_MS, rd->connect_timeout_ms);
+    /* Stalled means below 1 byte/s, curl only checks that in whole seconds */
+    curl_easy_setopt(rd->curl, CURLOPT_LOW_SPEED_LIMIT, rd->stall_timeout_ms > 0 ? 1L : 0L);
+    curl_easy_setopt(rd->curl, CURLOPT_LOW_SPEED_TIME, (rd->stall_timeout_ms + 999) / 1000);
     curl_easy_setopt(rd->curl, CURLOPT_PRIVATE, rd);
-    curl_easy_setopt(rd->curl, CURLOPT_WRITEFUNCTION, body_callback);
     curl_easy_setopt(rd->curl, CURLOPT_WRITEDATA, rd);
-    curl_easy_setopt(rd->curl, CURLOPT_HEADERFUNCTION, header_callback);
     curl_easy_setopt(rd->curl, CURLOPT_HEADERDATA, rd);
-    free(rd->method);
+    curl_easy_setopt(rd->curl, CURLOPT_READDATA, rd);
+    curl_easy_setopt(rd->curl, CURLOPT_SEEKDATA, rd);
+    request_string_free(rd, rd->method);
     rd->method = NULL;
-    free(rd->url);
+    request_string_free(rd, rd->url);
     rd->url = NULL;
-    if(rd->auth != NULL) {
-        free(rd->auth);
-        rd->auth = NULL;
+    request_string_free(rd, rd->auth);
+    rd->auth = NULL;
+    request_lines_free(rd, rd->cookies);
+    rd->cookies = NULL;
+    DEBUG_PRINT("adding handle");
+    loop->requests_started++;
+    loop->requests_in_flight++;
+    rd->state = REQUEST_RUNNING;
+    curl_multi_add_handle(loop->multi, rd->curl);
+    EXIT();
+}
+
+/* Over the memory budget a new request waits in the loop's queue, behind any already waiting,
+ * unless neither running transfers nor Python releasing could bring it down. Cancelled ones go
+ * straight through to be completed. Loop thread only */
+
+static void start_or_queue_request(EventLoop *loop, AcRequestData *rd)
+{
+    if(!rd->cancelled && (loop->budget_queued != NULL ||
+                          ((loop->requests_in_flight > 0 || budget_held_by_python(loop)) && budget_exceeded(loop) && budget_block(loop)))) {
+        rd->budget_next = NULL;
+        if(loop->budget_queued == NULL) {
+            loop->budget_queued = rd;
+        }
+        else {
+            loop->budget_queued_tail->budget_next = rd;
+        }
+        loop->budget_queued_tail = rd;
+        loop->budget_queued_len++;
+        loop->budget_waits++;
+        return;
     }
-    free(rd->cookies_str);
-    if(rd->dummy) {
-        rd->result = CURLE_OK;
-        curl_slist_free_all(rd->headers);
-        free(rd->req_data_buf);
-        write(loop->req_out_write, &rd, sizeof(AcRequestData *));
+    start_request(loop, rd);
+}
+
+/* Start the queued requests the budget allows, and the cancelled ones */
+
+static void start_queued_requests(EventLoop *loop)
+{
+    AcRequestData **link = &loop->budget_queued;
+    loop->budget_queued_tail = NULL;
+    while(*link != NULL) {
+        AcRequestData *rd = *link;
+        if(rd->cancelled || (loop->requests_in_flight == 0 && !budget_held_by_python(loop)) || !budget_exceeded(loop) || !budget_block(loop)) {
+            *link = rd->budget_next;
+            loop->budget_queued_len--;
+            start_request(loop, rd);
+        }
+        else {
+            loop->budget_queued_tail = rd;
+            link = &rd->budget_next;
+        }
     }
-    else {
-        DEBUG_PRINT("adding handle");
-        curl_multi_add_handle(loop->multi, rd->curl);
+}
+
+/* Resume what the budget held up, woken by buffered_sub, until it is used up again. Loop thread
+ * only */
+
+static void budget_unblock(EventLoop *loop)
+{
+    do {
+        while(loop->budget_paused != NULL && !budget_exceeded(loop)) {
+            AcRequestData *rd = loop->budget_paused;
+            loop->budget_paused = rd->budget_next;
+            loop->budget_paused_len--;
+            rd->budget_paused = false;
+            curl_easy_pause(rd->curl, CURLPAUSE_CONT); /* may pause it again */
+        }
+        start_queued_requests(loop);
+        budget_keep_going(loop);
+        /* Still held up, the next release has to wake the loop again */
+    } while((loop->budget_paused != NULL || loop->budget_queued != NULL) && !budget_block(loop));
+    response_complete(loop);
+}
+
+/* Stop the transfers of cancelled requests, closing their connections, and complete them so
+ * the Python side frees them. Loop thread only */
+
+void cancel_requests(EventLoop *loop)
+{
+    ENTER();
+    StackNode *node = stack_pop_all(&loop->cancelled_requests);
+    while(node != NULL) {
+        AcRequestData *rd = container_of(node, AcRequestData, cancel);
+        node = node->next;
+        REQUEST_TRACE_PRINT("cancel_requests", rd);
+        if(rd->state == REQUEST_QUEUED) {
+            /* Still in the submission ring, start_request completes it */
+            rd->cancelled = true;
+            loop->requests_cancelled++;
+        }
+        else if(rd->state == REQUEST_RUNNING) {
+            curl_multi_remove_handle(loop->multi, rd->curl);
+            stream_unlink_dirty(loop, rd);
+            budget_unlink_paused(loop, rd);
+            if(rd->sink == SINK_FD) {
+                rd->body_buffer.len = 0;
+            }
+            rd->cancelled = true;
+            rd->result = CURLE_ABORTED_BY_CALLBACK;
+            request_handle_release(loop, rd);
+            release_request_buffers(rd);
+            rd->state = REQUEST_DONE;
+            loop->requests_in_flight--;
+            loop->requests_cancelled++;
+            complete_request(loop, rd);
+        }
+        request_data_release(rd);
+    }
+    if(loop->budget_queued != NULL) {
+        start_queued_requests(loop);
     }
+    budget_keep_going(loop);
     EXIT();
 }
 
+/* Resume the streamed requests whose readers caught up and the uploads given more to send. Loop
+ * thread only */
 
-void stop_eventloop(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask)
+static void resume_streams(EventLoop *loop)
+{
+    StackNode *node = stack_pop_all(&loop->resumed_streams);
+    if(node == NULL) {
+        return;
+    }
+    while(node != NULL) {
+        AcRequestData *rd = container_of(node, AcRequestData, resume);
+        node = node->next;
+        __atomic_store_n(&rd->stream_resuming, 0, __ATOMIC_RELEASE);
+        stream_resume(loop, rd);
+        request_data_release(rd);
+    }
+    response_complete(loop);
+}
+
+/* Drain every request submitted since the last wakeup, one doorbell read per batch */
+
+void start_requests(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask)
 {
     ENTER();
-    char buffer[1];
+    AcRequestData *rd;
     EventLoop *loop = (EventLoop*)clientData;
-    read(loop->stop_read, buffer, sizeof(buffer));
-    loop->stop = true;
+    doorbell_clear(&loop->req_in_doorbell);
+    cleanup_retired_shares(loop);
+    cancel_requests(loop);
+    resume_streams(loop);
+    if(loop->budget_paused != NULL || loop->budget_queued != NULL) {
+        budget_unblock(loop);
+    }
+    while((rd = (AcRequestData *)ring_pop(&loop->req_in)) != NULL) {
+        start_or_queue_request(loop, rd);
+    }
     EXIT();
 }
 
-/* Used to cleanup curl handles by putting the handle back on a pipe to be picked up and cleaned up */
+/* Hand a request to the event loop thread. If the ring is full the loop thread is behind, so
+ * wait for it with the GIL released, or when nothing is running the loop drain it ourselves.
+ * The loop only starts running while it holds the GIL, so it can't start under us here */
 
-void curl_easy_cleanup_in_eventloop(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask)
+void submit_request(EventLoop *loop, AcRequestData *rd)
 {
     ENTER();
-    CURL *curl;
-    while(true) {
-        int b_read = read(fd, &curl, sizeof(CURL *));
-        if(b_read == -1) {
-            break;
+    if(loop->asyncio_loop != NULL) {
+        /* Adding the handle asks for an immediate timeout, run it now instead of on the next
+         * iteration of the asyncio loop so the request goes out before request() returns */
+        loop->asyncio_submitting = true;
+        start_or_queue_request(loop, rd);
+        loop->asyncio_submitting = false;
+        if(loop->asyncio_timeout_now) {
+            loop->asyncio_timeout_now = false;
+            socket_action_and_response_complete(loop, CURL_SOCKET_TIMEOUT, 0);
+        }
+        completion_queue_drain(loop->completions);
+        EXIT();
+        return;
+    }
+    while(unlikely(!ring_push(&loop->req_in, rd))) {
+        if(__atomic_load_n(&loop->running, __ATOMIC_ACQUIRE)) {
+            Py_BEGIN_ALLOW_THREADS
+            sched_yield();
+            Py_END_ALLOW_THREADS
+        }
+        else {
+            start_requests(loop->event_loop, loop->req_in_doorbell.read_fd, loop, AE_READABLE);
         }
-        DEBUG_PRINT("curl=%p", curl);
-        curl_easy_cleanup(curl);
     }
+    doorbell_ring(&loop->req_in_doorbell);
     EXIT();
 }
 
 
+void stop_eventloop(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask)
+{
+    ENTER();
+    char buffer[1];
+    EventLoop *loop = (EventLoop*)clientData;
+    read(loop->stop_read, buffer, sizeof(buffer));
+    loop->stop = true;
+    EXIT();
+}
+
 void socket_event(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask)
 {
     ENTER();
@@ -624,34 +3237,189 @@ void socket_event(struct aeEventLoop *eventLoop, int fd, void *clientData, int m
 }
 
 
+/* Driving curl from an asyncio loop: sockets are watched with add_reader/add_writer and the
+ * timeout scheduled with call_later, their callbacks run curl and resolve completed requests
+ * straight away on the asyncio thread. */
+
+static PyObject *asyncio_socket_event(PyObject *self, PyObject *args)
+{
+    ENTER();
+    int fd, ev_bitmask;
+    if(!PyArg_ParseTuple(args, "ii", &fd, &ev_bitmask)) {
+        EXIT();
+        return NULL;
+    }
+    EventLoop *loop = (EventLoop*)self;
+    socket_action_and_response_complete(loop, (curl_socket_t)fd, ev_bitmask);
+    completion_queue_drain(loop->completions);
+    Py_INCREF(Py_None);
+    EXIT();
+    return Py_None;
+}
+
+
+static PyObject *asyncio_timeout(PyObject *self, PyObject *args)
+{
+    ENTER();
+    EventLoop *loop = (EventLoop*)self;
+    Py_CLEAR(loop->asyncio_timer);
+    socket_action_and_response_complete(loop, CURL_SOCKET_TIMEOUT, 0);
+    completion_queue_drain(loop->completions);
+    Py_INCREF(Py_None);
+    EXIT();
+    return Py_None;
+}
+
+
+static PyMethodDef asyncio_socket_event_def = {"_socket_event", asyncio_socket_event, METH_VARARGS, NULL};
+static PyMethodDef asyncio_timeout_def = {"_timeout", asyncio_timeout, METH_NOARGS, NULL};
+
+
+/* Watch or stop watching s for the directions that changed between oldmask and mask. The
+ * callbacks are passed the socket and the matching CURL_CSELECT_* bit */
+
+static void asyncio_set_socket_events(EventLoop *loop, curl_socket_t s, int oldmask, int mask)
+{
+    ENTER();
+    PyObject *fd = PyLong_FromLong((long)s);
+    PyObject *callback = PyCFunction_New(&asyncio_socket_event_def, (PyObject*)loop);
+    PyObject *rtn = Py_None;
+    Py_INCREF(rtn);
+    if((mask & AE_READABLE) && !(oldmask & AE_READABLE)) {
+        PyObject *in = PyLong_FromLong(CURL_CSELECT_IN);
+        Py_XSETREF(rtn, PyObject_CallMethodObjArgs(loop->asyncio_loop, str_add_reader, fd, callback, fd, in, NULL));
+        Py_DECREF(in);
+    }
+    else if(!(mask & AE_READABLE) && (oldmask & AE_READABLE)) {
+        Py_XSETREF(rtn, PyObject_CallMethodObjArgs(loop->asyncio_loop, str_remove_reader, fd, NULL));
+    }
+    if(rtn != NULL) {
+        if((mask & AE_WRITABLE) && !(oldmask & AE_WRITABLE)) {
+            PyObject *out = PyLong_FromLong(CURL_CSELECT_OUT);
+            Py_XSETREF(rtn, PyObject_CallMethodObjArgs(loop->asyncio_loop, str_add_writer, fd, callback, fd, out, NULL));
+            Py_DECREF(out);
+        }
+        else if(!(mask & AE_WRITABLE) && (oldmask & AE_WRITABLE)) {
+            Py_XSETREF(rtn, PyObject_CallMethodObjArgs(loop->asyncio_loop, str_remove_writer, fd, NULL));
+        }
+    }
+    if(rtn == NULL) {
+        /* curl's socket callback has no way to report the failure */
+        PyErr_WriteUnraisable(loop->asyncio_loop);
+    }
+    Py_XDECREF(rtn);
+    Py_DECREF(callback);
+    Py_DECREF(fd);
+    EXIT();
+}
+
+
+static PyObject *asyncio_budget(PyObject *self, PyObject *args)
+{
+    ENTER();
+    EventLoop *loop = (EventLoop*)self;
+    budget_unblock(loop);
+    completion_queue_drain(loop->completions);
+    Py_INCREF(Py_None);
+    EXIT();
+    return Py_None;
+}
+
+static PyMethodDef asyncio_budget_def = {"_budget", asyncio_budget, METH_NOARGS, NULL};
+
+/* Have the loop carry on with what the memory budget held up. Driven from asyncio this can be
+ * called from any deallocation, so it is left to the next iteration */
+
+static void budget_wake(EventLoop *loop)
+{
+    if(loop->asyncio_loop == NULL) {
+        doorbell_ring(&loop->req_in_doorbell);
+        return;
+    }
+    PyObject *callback = PyCFunction_New(&asyncio_budget_def, (PyObject*)loop);
+    PyObject *handle = PyObject_CallMethodObjArgs(loop->asyncio_loop, str_call_soon, callback, NULL);
+    if(handle == NULL) {
+        PyErr_WriteUnraisable(loop->asyncio_loop);
+    }
+    Py_XDECREF(handle);
+    Py_DECREF(callback);
+}
+
+static void asyncio_set_timer(EventLoop *loop, long timeout_ms)
+{
+    ENTER();
+    if(loop->asyncio_timer != NULL) {
+        PyObject *rtn = PyObject_CallMethodObjArgs(loop->asyncio_timer, str_cancel, NULL);
+        if(rtn == NULL) {
+            PyErr_WriteUnraisable(loop->asyncio_timer);
+        }
+        Py_XDECREF(rtn);
+        Py_CLEAR(loop->asyncio_timer);
+    }
+    loop->asyncio_timeout_now = false;
+    if(timeout_ms == 0 && loop->asyncio_submitting) {
+        loop->asyncio_timeout_now = true;
+    }
+    else if(timeout_ms >= 0) {
+        PyObject *delay = PyFloat_FromDouble(timeout_ms / 1000.0);
+        PyObject *callback = PyCFunction_New(&asyncio_timeout_def, (PyObject*)loop);
+        loop->asyncio_timer = PyObject_CallMethodObjArgs(loop->asyncio_loop, str_call_later, delay, callback, NULL);
+        if(loop->asyncio_timer == NULL) {
+            PyErr_WriteUnraisable(loop->asyncio_loop);
+        }
+        Py_DECREF(callback);
+        Py_DECREF(delay);
+    }
+    EXIT();
+}
+
+
 int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp)
 {
     ENTER();
     EventLoop *loop = (EventLoop*)userp;
+    int mask;
     switch(what) {
-        case CURL_POLL_NONE:
-            DEBUG_PRINT("NONE socket=%d what=%d easy=%p", s, what, easy);
-            //do nothing
-            break;
         case CURL_POLL_IN:
             DEBUG_PRINT("IN socket=%d what=%d easy=%p", s, what, easy);
-            aeCreateFileEvent(loop->event_loop, (int)s, AE_READABLE, socket_event, (void*)loop);
-            aeDeleteFileEvent(loop->event_loop, (int)s, AE_WRITABLE);
+            mask = AE_READABLE | loop->socket_edge;
             break;
         case CURL_POLL_OUT:
             DEBUG_PRINT("OUT socket=%d what=%d easy=%p", s, what, easy);
-            aeCreateFileEvent(loop->event_loop, (int)s, AE_WRITABLE, socket_event, (void*)loop);
-            aeDeleteFileEvent(loop->event_loop, (int)s, AE_READABLE);
+            mask = AE_WRITABLE | loop->socket_edge;
             break;
         case CURL_POLL_INOUT:
             DEBUG_PRINT("INOUT socket=%d what=%d easy=%p", s, what, easy);
-            aeCreateFileEvent(loop->event_loop, (int)s, AE_READABLE | AE_WRITABLE, socket_event, (void*)loop);
+            mask = AE_READABLE | AE_WRITABLE | loop->socket_edge;
             break;
         case CURL_POLL_REMOVE:
             DEBUG_PRINT("REMOVE socket=%d what=%d easy=%p", s, what, easy);
-            aeDeleteFileEvent(loop->event_loop, (int)s, AE_READABLE | AE_WRITABLE);
+            mask = AE_NONE;
             break;
+        default:
+            DEBUG_PRINT("NONE socket=%d what=%d easy=%p", s, what, easy);
+            //do nothing
+            EXIT();
+            return 0;
     };
+    if(loop->asyncio_loop != NULL) {
+        /* The socket's current mask is kept by the loop, so stop can find every watched one */
+        if(s >= loop->asyncio_masks_len) {
+            int len = loop->asyncio_masks_len > 0 ? loop->asyncio_masks_len : 64;
+            while(len <= s) {
+                len *= 2;
+            }
+            loop->asyncio_masks = (unsigned char *)realloc(loop->asyncio_masks, len);
+            memset(loop->asyncio_masks + loop->asyncio_masks_len, 0, len - loop->asyncio_masks_len);
+            loop->asyncio_masks_len = len;
+        }
+        asyncio_set_socket_events(loop, s, loop->asyncio_masks[s], mask);
+        loop->asyncio_masks[s] = (unsigned char)mask;
+        EXIT();
+        return 0;
+    }
+    /* One polling API call for the whole transition, none if the interest didn't change */
+    aeSetFileEvents(loop->event_loop, (int)s, mask, socket_event, (void*)loop);
     EXIT();
     return 0; 
 }
@@ -675,6 +3443,11 @@ int timer_callback(CURLM *multi, long timeout_ms, void *userp)
     ENTER();
     DEBUG_PRINT("timeout_ms=%ld", timeout_ms);
     EventLoop *loop = (EventLoop*)userp;
+    if(loop->asyncio_loop != NULL) {
+        asyncio_set_timer(loop, timeout_ms);
+        EXIT();
+        return 0;
+    }
     if(loop->timer_id != NO_ACTIVE_TIMER_ID) {
         DEBUG_PRINT("DELETE timer_id=%ld", loop->timer_id);
         aeDeleteTimeEvent(loop->event_loop, loop->timer_id);
@@ -704,12 +3477,73 @@ static PyObject *
 EventLoop_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     ENTER();
-    EventLoop *self = (EventLoop *)type->tp_alloc(type, 0);
-    int req_in[2];
-    int req_out[2];
+    CompletionQueue *completions = NULL;
+    const char *backend = NULL;
+    int edge_triggered = 0;
+    PyObject *asyncio_loop = NULL;
+    long long memory_budget = 0;
+    int ae_flags = 0;
     int stop[2];
-    int curl_easy_cleanup[2];
+
+    static char *kwlist[] = {"completions", "backend", "edge_triggered", "asyncio_loop", "memory_budget", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O!zpOL", kwlist, &CompletionQueueType, &completions, &backend, &edge_triggered, &asyncio_loop,
+                                     &memory_budget)) {
+        EXIT();
+        return NULL;
+    }
+    if(backend != NULL) {
+        if(strcmp(backend, "io_uring") == 0) {
+            ae_flags |= AE_FLAG_IO_URING;
+        }
+        else if(strcmp(backend, aeGetApiName()) != 0 && strcmp(backend, "epoll") != 0) {
+            PyErr_Format(PyExc_ValueError, "unknown event loop backend '%s'", backend);
+            EXIT();
+            return NULL;
+        }
+    }
+    if(completions != NULL) {
+        Py_INCREF(completions);
+    }
+    else if((completions = (CompletionQueue *)PyObject_CallObject((PyObject *)&CompletionQueueType, NULL)) == NULL) {
+        EXIT();
+        return NULL;
+    }
+
+    EventLoop *self = (EventLoop *)type->tp_alloc(type, 0);
+    self->completions = completions;
     self->timer_id = NO_ACTIVE_TIMER_ID;
+    self->socket_edge = edge_triggered ? AE_EDGE : 0;
+    self->requests_started = 0;
+    self->free_handles = NULL;
+    self->free_handles_len = 0;
+    self->retired_shares.head = NULL;
+    self->cancelled_requests.head = NULL;
+    self->requests_in_flight = 0;
+    self->requests_cancelled = 0;
+    self->handle_pool_hits = 0;
+    self->handle_pool_misses = 0;
+    self->handles_live = 0;
+    self->returned_buffers.head = NULL;
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        self->free_buffers[i] = NULL;
+        self->free_buffers_len[i] = 0;
+    }
+    self->buffer_allocations = 0;
+    self->dirty_streams = NULL;
+    self->resumed_streams.head = NULL;
+    self->memory_budget = memory_budget > 0 ? memory_budget : 0;
+    self->budget_pauses = 0;
+    self->budget_waits = 0;
+    if(asyncio_loop == Py_None) {
+        asyncio_loop = NULL;
+    }
+    Py_XINCREF(asyncio_loop);
+    self->asyncio_loop = asyncio_loop;
+    self->asyncio_timer = NULL;
+    self->asyncio_masks = NULL;
+    self->asyncio_masks_len = 0;
+    self->asyncio_submitting = false;
+    self->asyncio_timeout_now = false;
     self->multi = curl_multi_init();
     curl_multi_setopt(self->multi, CURLMOPT_MAXCONNECTS, 1000);
     curl_multi_setopt(self->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
@@ -717,31 +3551,18 @@ EventLoop_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     curl_multi_setopt(self->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
     curl_multi_setopt(self->multi, CURLMOPT_TIMERDATA, self);
     if (self != NULL) {
-        self->event_loop = aeCreateEventLoop(200);
-        pipe(req_in);
-        self->req_in_read = req_in[0];
-        set_none_blocking(self->req_in_read);
-        self->req_in_write = req_in[1];
-        pipe(req_out);
-        self->req_out_read = req_out[0];
-        set_none_blocking(self->req_out_read);
-        self->req_out_write = req_out[1];
+        self->event_loop = aeCreateEventLoopWithFlags(200, ae_flags);
+        ring_init(&self->req_in, REQUEST_RING_SIZE);
+        doorbell_init(&self->req_in_doorbell);
         pipe(stop);
         self->stop_read = stop[0];
         self->stop_write = stop[1];
-        pipe(curl_easy_cleanup);
-        self->curl_easy_cleanup_read = curl_easy_cleanup[0];
-        set_none_blocking(self->curl_easy_cleanup_read);
-        self->curl_easy_cleanup_write = curl_easy_cleanup[1];
-        if(aeCreateFileEvent(self->event_loop, self->req_in_read, AE_READABLE, start_request, self) == AE_ERR) {
+        if(aeCreateFileEvent(self->event_loop, self->req_in_doorbell.read_fd, AE_READABLE|AE_EDGE, start_requests, self) == AE_ERR) {
             exit(1);
         }
         if(aeCreateFileEvent(self->event_loop, self->stop_read, AE_READABLE, stop_eventloop, self) == AE_ERR) {
             exit(1);
         }
-        if(aeCreateFileEvent(self->event_loop, self->curl_easy_cleanup_read, AE_READABLE, curl_easy_cleanup_in_eventloop, NULL) == AE_ERR) {
-            exit(1);
-        }
     }
     EXIT();
     return (PyObject *)self;
@@ -753,16 +3574,25 @@ EventLoop_dealloc(EventLoop *self)
 {
     ENTER();
     DEBUG_PRINT("response=%p", self);
+    /* Anything curl still has to say during cleanup goes to the unused ae loop */
+    Py_CLEAR(self->asyncio_timer);
+    Py_CLEAR(self->asyncio_loop);
+    free(self->asyncio_masks);
+    cancel_requests(self);
+    while(self->free_handles != NULL) {
+        EasyHandle *handle = container_of(self->free_handles, EasyHandle, node);
+        self->free_handles = handle->node.next;
+        easy_handle_destroy(self, handle);
+    }
+    cleanup_retired_shares(self);
     curl_multi_cleanup(self->multi);
+    buffer_pool_free(self);
     aeDeleteEventLoop(self->event_loop);
-    close(self->req_in_read);
-    close(self->req_in_write);
-    close(self->req_out_read);
-    close(self->req_out_write);
+    ring_free(&self->req_in);
+    doorbell_free(&self->req_in_doorbell);
+    Py_XDECREF(self->completions);
     close(self->stop_read);
     close(self->stop_write);
-    close(self->curl_easy_cleanup_read);
-    close(self->curl_easy_cleanup_write);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -779,16 +3609,45 @@ EventLoop_once(EventLoop *self, PyObject *args)
 
 
 static PyObject *
-EventLoop_main(EventLoop *self, PyObject *args)
+EventLoop_main(EventLoop *self, PyObject *args, PyObject *kwds)
 {
     ENTER();
+    int cpu = -1;
+    static char *kwlist[] = {"cpu", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &cpu)) {
+        EXIT();
+        return NULL;
+    }
+    if(self->asyncio_loop != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "event loop is driven by its asyncio loop");
+        EXIT();
+        return NULL;
+    }
+    if(cpu >= 0) {
+#ifdef __linux__
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if(err != 0) {
+            errno = err;
+            PyErr_SetFromErrno(PyExc_OSError);
+            EXIT();
+            return NULL;
+        }
+#endif
+    }
     DEBUG_PRINT("Started");
+    /* Set while still holding the GIL: a submitter holding it that sees the loop not running
+     * knows this thread can't be in aeProcessEvents until it gets the GIL back */
+    __atomic_store_n(&self->running, true, __ATOMIC_RELEASE);
     self->thread_state = PyEval_SaveThread();
     do {
         DEBUG_PRINT("Start of aeProcessEvents");
         aeProcessEvents(self->event_loop, AE_ALL_EVENTS);
         DEBUG_PRINT("End of aeProcessEvents");
     } while(!self->stop);
+    __atomic_store_n(&self->running, false, __ATOMIC_RELEASE);
     PyEval_RestoreThread(self->thread_state);
     DEBUG_PRINT("Ended");
     Py_INCREF(Py_None);
@@ -801,7 +3660,22 @@ static PyObject *
 EventLoop_stop(PyObject *self, PyObject *args)
 {
     ENTER();
-    write(((EventLoop*)self)->stop_write, '\0', 1);
+    EventLoop *loop = (EventLoop*)self;
+    if(loop->asyncio_loop != NULL) {
+        /* Nothing to wake, stop watching curl's sockets and timeout on the asyncio loop. As with
+         * a thread, transfers still running are left where they are */
+        asyncio_set_timer(loop, -1);
+        for(int s = 0; s < loop->asyncio_masks_len; s++) {
+            if(loop->asyncio_masks[s] != AE_NONE) {
+                asyncio_set_socket_events(loop, s, loop->asyncio_masks[s], AE_NONE);
+                loop->asyncio_masks[s] = AE_NONE;
+            }
+        }
+        Py_INCREF(Py_None);
+        EXIT();
+        return Py_None;
+    }
+    write(loop->stop_write, "", 1);
     Py_INCREF(Py_None);
     EXIT();
     return Py_None;
@@ -814,69 +3688,83 @@ Eventloop_get_out_fd(PyObject *self, PyObject *args)
 {
     ENTER();
     DEBUG_PRINT("");
-    PyObject *rtn = Py_BuildValue("i", ((EventLoop*)self)->req_out_read);
+    PyObject *rtn = CompletionQueue_fileno((PyObject*)((EventLoop*)self)->completions, NULL);
     EXIT();
     return rtn;
 }
 
 
 static PyObject *
-Eventloop_get_completed(PyObject *self, PyObject *args)
+Eventloop_complete(PyObject *self, PyObject *args)
 {
-    ENTER();
-    AcRequestData *rd;
-    PyObject *list = PyList_New(0);
-    while(true) {
-        int b_read = read(((EventLoop*)self)->req_out_read, &rd, sizeof(AcRequestData *));
-        if(b_read == -1) {
-            break;
-        }
-        REQUEST_TRACE_PRINT("Eventloop_get_completed", rd);
-        DEBUG_PRINT("read AcRequestData; address=%p", rd);
-        PyObject *tuple = PyTuple_New(3);
-        if(rd->result == CURLE_OK) {
-            Response *response = PyObject_New(Response, (PyTypeObject *)&ResponseType);
-            response->header_buffer = rd->header_buffer_head;
-            response->body_buffer = rd->body_buffer_head;
-            response->curl = rd->curl;
-            response->session = rd->session;
+    return CompletionQueue_complete((PyObject*)((EventLoop*)self)->completions, args);
+}
+
+
+static PyObject *
+Eventloop_get_completions(PyObject *self, PyObject *args)
+{
+    PyObject *rtn = (PyObject*)((EventLoop*)self)->completions;
+    Py_INCREF(rtn);
+    return rtn;
+}
+
+
+static PyObject *
+Eventloop_get_backend(PyObject *self, PyObject *args)
+{
+    EventLoop *loop = (EventLoop*)self;
+    if(loop->asyncio_loop != NULL) {
+        return PyUnicode_FromString("asyncio");
+    }
+    return PyUnicode_FromString(aeGetEventLoopApiName(loop->event_loop));
+}
+
+
+/* Counters kept by the loop thread, read without synchronisation so only approximate while it runs */
 
-            Py_INCREF(Py_None);
-            PyTuple_SET_ITEM(tuple, 0, Py_None);
-            PyTuple_SET_ITEM(tuple, 1, (PyObject*)response);
-            PyTuple_SET_ITEM(tuple, 2, rd->future);
-        }
-        else {
-            PyObject* error = PyUnicode_FromString(curl_easy_strerror(rd->result));
-            free_buffer_nodes(rd->header_buffer_head);
-            free_buffer_nodes(rd->body_buffer_head);
-            curl_easy_cleanup(rd->curl);
-            Py_DECREF(rd->session);
-            
-            PyTuple_SET_ITEM(tuple, 0, error);
-            Py_INCREF(Py_None);
-            PyTuple_SET_ITEM(tuple, 1, Py_None);
-            PyTuple_SET_ITEM(tuple, 2, rd->future);
-        }
-        PyList_Append(list, tuple);
-        Py_DECREF(tuple);
-        if(rd->req_data_buf != NULL) {
-            free(rd->req_data_buf);
-        }
-        Py_XDECREF(rd->cookies);
-        free(rd);
+static PyObject *
+Eventloop_get_stats(PyObject *self, PyObject *args)
+{
+    EventLoop *loop = (EventLoop*)self;
+    int buffers_idle = 0;
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        buffers_idle += loop->free_buffers_len[i];
     }
-    EXIT();
-    return list;
+    return Py_BuildValue("{s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:i,s:L,s:i,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L}",
+        "requests", loop->requests_started,
+        "in_flight", loop->requests_in_flight,
+        "cancelled", loop->requests_cancelled,
+        "registrations", loop->event_loop->statRegistrations,
+        "polls", loop->event_loop->statPolls,
+        "events", loop->event_loop->statFiredEvents,
+        "handle_pool_hits", loop->handle_pool_hits,
+        "handle_pool_misses", loop->handle_pool_misses,
+        "handles_live", loop->handles_live,
+        "handles_idle", loop->free_handles_len,
+        "buffer_allocations", loop->buffer_allocations,
+        "buffers_idle", buffers_idle,
+        "buffer_memory", loop->buffer_memory,
+        "buffered_bytes", __atomic_load_n(&loop->buffered_bytes, __ATOMIC_RELAXED),
+        "budget_paused", loop->budget_paused_len,
+        "budget_queued", loop->budget_queued_len,
+        "budget_pauses", loop->budget_pauses,
+        "budget_waits", loop->budget_waits,
+        "curl_memory", __atomic_load_n(&curl_memory, __ATOMIC_RELAXED),
+        "request_allocations", request_allocations,
+        "response_allocations", response_allocations);
 }
 
 
 static PyMethodDef EventLoop_methods[] = {
-    {"main", (PyCFunction)EventLoop_main, METH_NOARGS, "Run the event loop"},
+    {"main", (PyCFunction)EventLoop_main, METH_VARARGS | METH_KEYWORDS, "Run the event loop, optionally pinned to a cpu"},
     {"once", (PyCFunction)EventLoop_once, METH_NOARGS, "Run the event loop once"},
     {"stop", EventLoop_stop, METH_NOARGS, "Stop the event loop"},
     {"get_out_fd", Eventloop_get_out_fd, METH_NOARGS, "Get the outbound file dscriptor"},
-    {"get_completed", Eventloop_get_completed, METH_NOARGS, "Get the user_object, response and error"},
+    {"complete", Eventloop_complete, METH_NOARGS, "Resolve the futures of completed requests"},
+    {"get_completions", Eventloop_get_completions, METH_NOARGS, "Get the completion queue"},
+    {"get_backend", Eventloop_get_backend, METH_NOARGS, "Get the name of the polling backend in use"},
+    {"get_stats", Eventloop_get_stats, METH_NOARGS, "Get the request, cancellation, polling, handle and buffer pool and curl memory counters"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -950,10 +3838,8 @@ Session_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     
     Py_INCREF(loop);
     self->loop = loop;
-    self->shared = curl_share_init();
-    curl_share_setopt(self->shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
-    curl_share_setopt(self->shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
-    curl_share_setopt(self->shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    self->in_flight = NULL;
+    self->share = NULL;
     EXIT();
     return (PyObject *)self;
 }
@@ -964,48 +3850,318 @@ Session_dealloc(Session *self)
 {
     ENTER();
     DEBUG_PRINT("response=%p", self);
-    curl_share_cleanup(self->shared);
+    /* Idle handles in the loop's pool may still be attached to the share, so the loop thread
+     * cleans it up. The doorbell wakes it, or the loop's own dealloc gets to it */
+    if(self->share != NULL) {
+        jar_detach(self->share);
+        stack_push(&self->loop->retired_shares, &self->share->node);
+        if(self->loop->asyncio_loop != NULL) {
+            cleanup_retired_shares(self->loop);
+        }
+        else {
+            doorbell_ring(&self->loop->req_in_doorbell);
+        }
+    }
     Py_XDECREF(self->loop);
     Py_TYPE(self)->tp_free((PyObject*)self);
     EXIT();
 }
 
 
+/* Arguments of a METH_FASTCALL | METH_KEYWORDS call in the order of names (interned), borrowed
+ * and NULL when not given. The first required of them must be */
+
+static bool fastcall_args(PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames, PyObject **names, int count,
+                          int required, PyObject **values)
+{
+    if(nargs > count) {
+        PyErr_Format(PyExc_TypeError, "takes at most %d arguments (%zd given)", count, nargs);
+        return false;
+    }
+    memset(values, 0, count * sizeof(PyObject *));
+    memcpy(values, args, nargs * sizeof(PyObject *));
+    Py_ssize_t nkw = kwnames != NULL ? PyTuple_GET_SIZE(kwnames) : 0;
+    int next = (int)nargs;
+    for(Py_ssize_t i = 0; i < nkw; i++) {
+        PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+        /* Keywords are interned constants in the caller's code and usually come in order */
+        int j = -1;
+        for(int k = 0; k < count && j < 0; k++) {
+            if(names[(next + k) % count] == name) {
+                j = (next + k) % count;
+            }
+        }
+        for(int k = 0; k < count && j < 0; k++) {
+            if(PyUnicode_Compare(names[k], name) == 0) {
+                j = k;
+            }
+        }
+        if(j < 0) {
+            PyErr_Format(PyExc_TypeError, "'%U' is an invalid keyword argument", name);
+            return false;
+        }
+        if(values[j] != NULL) {
+            PyErr_Format(PyExc_TypeError, "argument '%U' given twice", name);
+            return false;
+        }
+        values[j] = args[nargs + i];
+        next = j + 1;
+    }
+    for(int j = 0; j < required; j++) {
+        if(values[j] == NULL) {
+            PyErr_Format(PyExc_TypeError, "missing required argument '%U'", names[j]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The UTF-8 of a str, the contents of bytes, or the UTF-8 of str() of anything else, which is
+ * returned in temp to be released after use */
+
+static const char *request_text(PyObject *obj, Py_ssize_t *len, PyObject **temp)
+{
+    *temp = NULL;
+    if(PyUnicode_Check(obj)) {
+        return PyUnicode_AsUTF8AndSize(obj, len);
+    }
+    if(PyBytes_Check(obj)) {
+        *len = PyBytes_GET_SIZE(obj);
+        return PyBytes_AS_STRING(obj);
+    }
+    *temp = PyObject_Str(obj);
+    return *temp != NULL ? PyUnicode_AsUTF8AndSize(*temp, len) : NULL;
+}
+
+/* Append to a header or cookie list a line per item of a sequence of str or bytes. Cookies can
+ * also be acurl.Cookie objects, added as their format() */
+
+static bool request_lines_add(AcRequestData *rd, struct curl_slist ***tail, PyObject *lines, bool cookies)
+{
+    PyObject *seq = PySequence_Fast(lines, cookies ? "cookie_list should be a sequence of Cookie, str or bytes" :
+                                                     "headers_list should be a sequence of str or bytes");
+    if(seq == NULL) {
+        return false;
+    }
+    for(Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        PyObject *temp = NULL;
+        const char *text = NULL;
+        Py_ssize_t len;
+        if(PyUnicode_Check(item) || PyBytes_Check(item)) {
+            text = request_text(item, &len, &temp);
+        }
+        else if(cookies && (temp = PyObject_CallMethodObjArgs(item, str_format, NULL)) != NULL && PyUnicode_Check(temp)) {
+            text = PyUnicode_AsUTF8AndSize(temp, &len);
+        }
+        if(text == NULL) {
+            Py_XDECREF(temp);
+            Py_DECREF(seq);
+            if(!PyErr_Occurred() || cookies) {
+                PyErr_Clear();
+                PyErr_SetString(PyExc_ValueError, cookies ? "cookie_list should be a sequence of Cookie, str or bytes" :
+                                                            "headers_list should be a sequence of str or bytes");
+            }
+            return false;
+        }
+        struct curl_slist *node = request_line_alloc(rd, len);
+        if(node == NULL) {
+            Py_XDECREF(temp);
+            Py_DECREF(seq);
+            return false;
+        }
+        memcpy(node->data, text, len);
+        Py_XDECREF(temp);
+        **tail = node;
+        *tail = &node->next;
+    }
+    Py_DECREF(seq);
+    return true;
+}
+
+/* Append a prefix + name + separator + value line per item of a mapping, headers as "name: value"
+ * and cookies as Netscape lines */
+
+static bool request_items_add(AcRequestData *rd, struct curl_slist ***tail, PyObject *mapping, const char *prefix,
+                              size_t prefix_len, const char *separator)
+{
+    PyObject *items = NULL;
+    Py_ssize_t pos = 0, i = 0;
+    size_t separator_len = strlen(separator);
+    if(!PyDict_Check(mapping) && (items = PyMapping_Items(mapping)) == NULL) {
+        return false;
+    }
+    for(;;) {
+        PyObject *key, *value, *key_temp, *value_temp;
+        if(items == NULL) {
+            if(!PyDict_Next(mapping, &pos, &key, &value)) {
+                break;
+            }
+        }
+        else {
+            if(i == PyList_GET_SIZE(items)) {
+                break;
+            }
+            PyObject *item = PyList_GET_ITEM(items, i++);
+            if(!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+                PyErr_SetString(PyExc_ValueError, "items() should give (name, value) pairs");
+                Py_DECREF(items);
+                return false;
+            }
+            key = PyTuple_GET_ITEM(item, 0);
+            value = PyTuple_GET_ITEM(item, 1);
+        }
+        Py_ssize_t key_len, value_len;
+        const char *key_text = request_text(key, &key_len, &key_temp);
+        const char *value_text = key_text != NULL ? request_text(value, &value_len, &value_temp) : NULL;
+        if(value_text == NULL) {
+            Py_XDECREF(key_temp);
+            Py_XDECREF(items);
+            return false;
+        }
+        struct curl_slist *node = request_line_alloc(rd, prefix_len + key_len + separator_len + value_len);
+        if(node == NULL) {
+            Py_XDECREF(key_temp);
+            Py_XDECREF(value_temp);
+            Py_XDECREF(items);
+            return false;
+        }
+        char *line = node->data;
+        memcpy(line, prefix, prefix_len);
+        memcpy(line += prefix_len, key_text, key_len);
+        memcpy(line += key_len, separator, separator_len);
+        memcpy(line + separator_len, value_text, value_len);
+        Py_XDECREF(key_temp);
+        Py_XDECREF(value_temp);
+        **tail = node;
+        *tail = &node->next;
+    }
+    Py_XDECREF(items);
+    return true;
+}
+
+/* The cookies of a dict are session cookies for the url's host and its subdomains, like
+ * session_cookie_for_url */
+
+static bool request_cookie_items_add(AcRequestData *rd, struct curl_slist ***tail, PyObject *cookies, const char *url)
+{
+    const char *host = strstr(url, "://");
+    host = host != NULL ? host + 3 : url + strlen(url);
+    size_t host_len = strcspn(host, "/?#");
+    static const char fields[] = "\tTRUE\t/\tFALSE\t0\t";
+    char stack_prefix[256];
+    size_t prefix_len = 1 + host_len + sizeof(fields) - 1;
+    char *prefix = prefix_len <= sizeof(stack_prefix) ? stack_prefix : (char *)malloc(prefix_len);
+    prefix[0] = '.';
+    memcpy(prefix + 1, host, host_len);
+    memcpy(prefix + 1 + host_len, fields, sizeof(fields) - 1);
+    bool ok = request_items_add(rd, tail, cookies, prefix, prefix_len, "\t");
+    if(prefix != stack_prefix) {
+        free(prefix);
+    }
+    return ok;
+}
+
+/* The fd passed as data or sink, -1 with ValueError set unless it is a non-negative int */
+
+static int request_fd(PyObject *value, const char *name)
+{
+    long fd = PyLong_AsLong(value);
+    if(fd < 0 || fd > INT_MAX) {
+        if(!PyErr_Occurred() || PyErr_ExceptionMatches(PyExc_OverflowError)) {
+            PyErr_Clear();
+            PyErr_Format(PyExc_ValueError, "%s should be a non-negative file descriptor", name);
+        }
+        return -1;
+    }
+    return (int)fd;
+}
+
+/* Keywords of Session.request, interned at import */
+
+static const char *request_kwlist[] = {"future", "method", "url", "headers", "auth", "cookies", "data", "timeout",
+                                       "connect_timeout", "stall_timeout", "discard_body", "discard_headers", "checksum",
+                                       "stream", "high_water", "sink", "preallocate", "upload", "headers_list", "cookie_list",
+                                       "max_redirects"};
+#define REQUEST_ARGS (int)(sizeof(request_kwlist) / sizeof(request_kwlist[0]))
+static PyObject *request_kwnames[REQUEST_ARGS];
+
+/* Called through vectorcall, the headers and cookies go from their dicts and sequences straight
+ * into the request's lists */
+
 static PyObject *
-Session_request(Session *self, PyObject *args, PyObject *kwds)
+Session_request(Session *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
     ENTER();
-    char *method;
-    char *url;
-    PyObject *future;
-    PyObject *headers;
-    PyObject *auth;
-    PyObject *cookies;
-    int req_data_len = 0;
-    char *req_data_buf = NULL;
-    int dummy;
-    
-    static char *kwlist[] = {"future", "method", "url", "headers", "auth", "cookies", "data", "dummy", NULL};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OssOOOz#p", kwlist, &future, &method, &url, &headers, &auth, &cookies, &req_data_buf, &req_data_len, &dummy)) {
+    PyObject *values[REQUEST_ARGS];
+    if(!fastcall_args(args, nargs, kwnames, request_kwnames, REQUEST_ARGS, 3, values)) {
         EXIT();
         return NULL;
     }
-    
-    AcRequestData *rd = (AcRequestData *)malloc(sizeof(AcRequestData));
+    PyObject *future = values[0];
+    PyObject *headers = values[3] != NULL ? values[3] : Py_None;
+    PyObject *auth = values[4] != NULL ? values[4] : Py_None;
+    PyObject *cookies = values[5] != NULL ? values[5] : Py_None;
+    PyObject *data = values[6] != NULL ? values[6] : Py_None;
+    PyObject *stream = values[13] != NULL ? values[13] : Py_None;
+    PyObject *sink = values[15] != NULL ? values[15] : Py_None;
+    PyObject *upload = values[17] != NULL ? values[17] : Py_None;
+    PyObject *headers_list = values[18] != NULL ? values[18] : Py_None;
+    PyObject *cookie_list = values[19] != NULL ? values[19] : Py_None;
+    const char *method, *url;
+    double timeouts[3] = {0, 0, 0}; /* timeout, connect_timeout, stall_timeout */
+    int flags[4] = {0, 0, 0, 0}; /* discard_body, discard_headers, checksum, preallocate */
+    long long high_water = 1 << 20;
+    long max_redirects = -1;
+    if((method = PyUnicode_AsUTF8(values[1])) == NULL || (url = PyUnicode_AsUTF8(values[2])) == NULL) {
+        EXIT();
+        return NULL;
+    }
+    for(int i = 0; i < 3; i++) {
+        if(values[7 + i] != NULL && values[7 + i] != Py_None && (timeouts[i] = PyFloat_AsDouble(values[7 + i])) == -1 && PyErr_Occurred()) {
+            EXIT();
+            return NULL;
+        }
+    }
+    static const int flag_args[] = {10, 11, 12, 16};
+    for(int i = 0; i < 4; i++) {
+        if(values[flag_args[i]] != NULL && (flags[i] = PyObject_IsTrue(values[flag_args[i]])) < 0) {
+            EXIT();
+            return NULL;
+        }
+    }
+    if(values[14] != NULL && (high_water = PyLong_AsLongLong(values[14])) == -1 && PyErr_Occurred()) {
+        EXIT();
+        return NULL;
+    }
+    if(values[20] != NULL && values[20] != Py_None && (max_redirects = PyLong_AsLong(values[20])) == -1 && PyErr_Occurred()) {
+        EXIT();
+        return NULL;
+    }
+    int discard_body = flags[0], discard_headers = flags[1], checksum = flags[2], preallocate = flags[3];
+
+    AcRequestData *rd = request_data_alloc();
+    if(rd == NULL) {
+        EXIT();
+        return PyErr_NoMemory();
+    }
     REQUEST_TRACE_PRINT("Session_request", rd);
-    memset(rd, 0, sizeof(AcRequestData));
+    if((rd->method = request_strdup(rd, method)) == NULL || (rd->url = request_strdup(rd, url)) == NULL) {
+        goto error_cleanup;
+    }
+    /* headers_list goes first, then the headers given as a mapping */
+    struct curl_slist **header_tail = &rd->headers;
+    if(headers_list != Py_None && !request_lines_add(rd, &header_tail, headers_list, false)) {
+        goto error_cleanup;
+    }
     if(headers != Py_None) {
-        if(!PyTuple_CheckExact(headers)) {
-            PyErr_SetString(PyExc_ValueError, "headers should be a tuple of strings or None");
-            goto error_cleanup;
-        }
-        for(int i=0; i < PyTuple_GET_SIZE(headers); i++) {
-            if(!PyUnicode_CheckExact(PyTuple_GET_ITEM(headers, i))) {
-                PyErr_SetString(PyExc_ValueError, "headers should be a tuple of strings or None");
+        if(PyTuple_Check(headers) || PyList_Check(headers)) {
+            if(!request_lines_add(rd, &header_tail, headers, false)) {
                 goto error_cleanup;
             }
-            rd->headers = curl_slist_append(rd->headers, PyUnicode_AsUTF8(PyTuple_GET_ITEM(headers, i)));
+        }
+        else if(!request_items_add(rd, &header_tail, headers, "", 0, ": ")) {
+            goto error_cleanup;
         }
     }
     if(auth != Py_None) {
@@ -1013,70 +4169,449 @@ Session_request(Session *self, PyObject *args, PyObject *kwds)
             PyErr_SetString(PyExc_ValueError, "auth should be a tuple of strings (username, password) or None");
             goto error_cleanup;
         }
-        char *username = PyUnicode_AsUTF8(PyTuple_GET_ITEM(auth, 0));
-        char *password = PyUnicode_AsUTF8(PyTuple_GET_ITEM(auth, 1));
-        rd->auth = (char*)malloc(strlen(username) + 1 + strlen(password) + 1);
-        sprintf(rd->auth, "%s:%s", username, password);
+        const char *username = PyUnicode_AsUTF8(PyTuple_GET_ITEM(auth, 0));
+        const char *password = PyUnicode_AsUTF8(PyTuple_GET_ITEM(auth, 1));
+        size_t size = strlen(username) + 1 + strlen(password) + 1;
+        if((rd->auth = request_string_alloc(rd, size)) == NULL) {
+            goto error_cleanup;
+        }
+        snprintf(rd->auth, size, "%s:%s", username, password);
+    }
+    /* cookie_list goes first, then the cookies given as a mapping */
+    struct curl_slist **cookie_tail = &rd->cookies;
+    if(cookie_list != Py_None && !request_lines_add(rd, &cookie_tail, cookie_list, true)) {
+        goto error_cleanup;
     }
     if(cookies != Py_None) {
-        Py_INCREF(cookies);
-        rd->cookies = cookies;
-        if(!PyTuple_CheckExact(cookies)) {
-            PyErr_SetString(PyExc_ValueError, "cookies should be a tuple of strings or None");
+        if(PyTuple_Check(cookies) || PyList_Check(cookies)) {
+            if(!request_lines_add(rd, &cookie_tail, cookies, true)) {
+                goto error_cleanup;
+            }
+        }
+        else if(!request_cookie_items_add(rd, &cookie_tail, cookies, url)) {
             goto error_cleanup;
         }
-        rd->cookies_len = PyTuple_GET_SIZE(cookies);
-        if(rd->cookies_len > 0) {
-            rd->cookies_str = (char**)calloc(PyTuple_GET_SIZE(cookies), sizeof(char*));
-            for(int i=0; i < PyTuple_GET_SIZE(cookies); i++) {
-                if(!PyUnicode_CheckExact(PyTuple_GET_ITEM(cookies, i))) {
-                    PyErr_SetString(PyExc_ValueError, "cookies should be a tuple of strings or None");
-                    goto error_cleanup;
-                }
-                rd->cookies_str[i] = PyUnicode_AsUTF8(PyTuple_GET_ITEM(cookies, i));
+    }
+    if(upload != Py_None) {
+        /* The body is pushed through Session.upload */
+        Py_INCREF(upload);
+        rd->upload_feeder = upload;
+        rd->upload = UPLOAD_CHUNKS;
+        rd->upload_size = -1;
+    }
+    else if(PyLong_Check(data) && !PyBool_Check(data)) {
+        /* Read from the fd's current offset to the end, which is left where it was */
+        struct stat st;
+        int fd = request_fd(data, "data");
+        if(fd < 0) {
+            goto error_cleanup;
+        }
+        rd->upload = UPLOAD_FD;
+        rd->upload_fd = fd;
+        rd->upload_offset = lseek(rd->upload_fd, 0, SEEK_CUR); /* -1 for pipes and sockets */
+        rd->upload_size = -1;
+        if(rd->upload_offset >= 0 && fstat(rd->upload_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            rd->upload_size = st.st_size > rd->upload_offset ? st.st_size - rd->upload_offset : 0;
+        }
+    }
+    else if(data != Py_None) {
+        /* Held by reference, so one payload can be sent by any number of requests without a copy */
+        if(PyUnicode_Check(data)) {
+            PyObject *encoded = PyUnicode_AsUTF8String(data);
+            if(encoded == NULL) {
+                goto error_cleanup;
             }
+            PyObject_GetBuffer(encoded, &rd->req_data, PyBUF_SIMPLE);
+            Py_DECREF(encoded);
+        }
+        else if(PyObject_GetBuffer(data, &rd->req_data, PyBUF_SIMPLE) < 0) {
+            PyErr_Clear();
+            PyErr_SetString(PyExc_ValueError, "data should be a str, a contiguous buffer (bytes, bytearray, memoryview...), a file descriptor or None");
+            goto error_cleanup;
+        }
+        rd->req_data_buf = rd->req_data.buf;
+        rd->req_data_len = rd->req_data.len;
+    }
+    if(sink != Py_None) {
+        if(PyLong_Check(sink) && !PyBool_Check(sink)) {
+            int fd = request_fd(sink, "sink");
+            if(fd < 0) {
+                goto error_cleanup;
+            }
+            rd->sink = SINK_FD;
+            rd->sink_fd = fd;
+            rd->sink_offset = lseek(rd->sink_fd, 0, SEEK_CUR); /* -1 for pipes and sockets */
+            rd->sink_preallocate = preallocate;
+        }
+        else if(PyObject_GetBuffer(sink, &rd->sink_view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) == 0) {
+            rd->sink = SINK_BUFFER;
+        }
+        else {
+            PyErr_Clear();
+            PyErr_SetString(PyExc_ValueError, "sink should be a file descriptor, a writable contiguous buffer or None");
+            goto error_cleanup;
         }
     }
     
+    if(session_share(self) == NULL) { /* before the loop thread can look at it */
+        goto error_cleanup;
+    }
+    /* The slot is only reused from the pool, so a stale handle tells by the serial */
+    PyObject *handle = PyCapsule_New(rd, "acurl.request", NULL);
+    if(handle == NULL) {
+        goto error_cleanup;
+    }
+    rd->serial = ++request_serial;
+    PyCapsule_SetContext(handle, (void *)rd->serial);
     Py_INCREF(self);
     rd->session = self;
     Py_INCREF(future);
     rd->future = future;
-    rd->method = strdup(method);
-    rd->url = strdup(url);
-    if(req_data_buf != NULL) {
-        req_data_buf = strdup(req_data_buf);
+    if(stream != Py_None) {
+        Py_INCREF(stream);
+        rd->stream = stream;
+        rd->stream_high_water = high_water > 0 ? high_water : 1;
     }
+    /* Round up so a small positive timeout doesn't turn into none */
+    rd->timeout_ms = timeouts[0] > 0 ? (long)(timeouts[0] * 1000 + 0.999) : 0;
+    rd->connect_timeout_ms = timeouts[1] > 0 ? (long)(timeouts[1] * 1000 + 0.999) : 0;
+    rd->stall_timeout_ms = timeouts[2] > 0 ? (long)(timeouts[2] * 1000 + 0.999) : 0;
+    rd->body_flags = (discard_body ? REQUEST_DISCARD_BODY : 0) | (discard_headers ? REQUEST_DISCARD_HEADERS : 0) | (checksum ? REQUEST_CHECKSUM : 0);
+    rd->checksum = 1;
+    rd->requested_sink = rd->sink;
+    rd->requested_body_flags = rd->body_flags;
+    rd->max_redirects = max_redirects < 0 || max_redirects > INT_MAX ? -1 : (int)max_redirects;
+    rd->refs = 1;
+    rd->state = REQUEST_QUEUED;
+    rd->in_flight_next = self->in_flight;
+    if(self->in_flight != NULL) {
+        self->in_flight->in_flight_prev = rd;
+    }
+    self->in_flight = rd;
+    self->in_flight_len++;
 
-    rd->req_data_len = req_data_len;
-    rd->req_data_buf = req_data_buf;
-    rd->dummy = dummy;
-
-    write(self->loop->req_in_write, &rd, sizeof(AcRequestData *));
+    submit_request(self->loop, rd);
     DEBUG_PRINT("scheduling request");
-    Py_INCREF(Py_None);
     EXIT();
-    return Py_None;
+    return handle;
     
     error_cleanup:
-    if(rd->headers) {
-        curl_slist_free_all(rd->headers);
+    request_string_free(rd, rd->method);
+    request_string_free(rd, rd->url);
+    request_string_free(rd, rd->auth);
+    request_lines_free(rd, rd->headers);
+    request_lines_free(rd, rd->cookies);
+    if(rd->sink_view.obj != NULL) {
+        PyBuffer_Release(&rd->sink_view);
     }
-    if(rd->auth) {
-        free(rd->auth);
+    if(rd->req_data.obj != NULL) {
+        PyBuffer_Release(&rd->req_data);
     }
-    if(rd->cookies) {
-        Py_DECREF(rd->cookies);
-        free(rd->cookies_str);
-    }
-    free(rd);
+    Py_XDECREF(rd->upload_feeder);
+    request_data_free(rd);
     EXIT();
     return NULL;
 }
 
 
+/* The request of a handle from Session.request, NULL once it is no longer in flight or with an
+ * exception set if handle isn't one. GIL */
+
+static AcRequestData *session_request_get(Session *self, PyObject *handle)
+{
+    AcRequestData *rd = (AcRequestData *)PyCapsule_GetPointer(handle, "acurl.request");
+    if(rd == NULL || rd->serial != (uintptr_t)PyCapsule_GetContext(handle) || rd->session != self) {
+        return NULL;
+    }
+    return rd;
+}
+
+/* Have the loop thread stop the request of a handle. Its future is cancelled when the loop hands
+ * the request back */
+
+static PyObject *
+Session_cancel(Session *self, PyObject *handle)
+{
+    ENTER();
+    AcRequestData *rd = session_request_get(self, handle);
+    if(rd == NULL) {
+        EXIT();
+        if(PyErr_Occurred()) {
+            return NULL;
+        }
+        Py_RETURN_FALSE;
+    }
+    EventLoop *loop = self->loop;
+    if(__atomic_exchange_n(&rd->cancel_requested, 1, __ATOMIC_ACQ_REL) != 0) {
+        /* Already on its way to the loop thread */
+        EXIT();
+        Py_RETURN_TRUE;
+    }
+    __atomic_add_fetch(&rd->refs, 1, __ATOMIC_RELAXED);
+    stack_push(&loop->cancelled_requests, &rd->cancel);
+    if(loop->asyncio_loop != NULL) {
+        cancel_requests(loop);
+        completion_queue_drain(loop->completions);
+    }
+    else {
+        doorbell_ring(&loop->req_in_doorbell);
+    }
+    EXIT();
+    Py_RETURN_TRUE;
+}
+
+
+static PyObject *
+Session_get_stats(Session *self, PyObject *args)
+{
+    return Py_BuildValue("{s:L,s:L}",
+        "in_flight", self->in_flight_len,
+        "buffered_bytes", __atomic_load_n(&self->buffered_bytes, __ATOMIC_RELAXED));
+}
+
+
+/* The cookie jar is read and changed from the Python side through jar_handle, the loop thread
+ * is only held up for as long as curl holds the share's cookie lock */
+
+static PyObject *
+Session_get_cookies(Session *self, PyObject *args)
+{
+    ENTER();
+    PyObject *rtn = jar_export(session_share(self), true);
+    EXIT();
+    return rtn;
+}
+
+/* A cookie tuple as curl's Netscape line, in *line which grows to fit */
+
+static const char *cookie_tuple_line(PyObject *cookie, char **line, size_t *size)
+{
+    static const int text_items[] = {1, 3, 6, 7}; /* domain, path, name, value */
+    PyObject *temps[4] = {NULL, NULL, NULL, NULL};
+    const char *text[4];
+    Py_ssize_t lens[4];
+    const char *rtn = NULL;
+    int http_only = PyObject_IsTrue(PyTuple_GET_ITEM(cookie, 0));
+    int include_subdomains = PyObject_IsTrue(PyTuple_GET_ITEM(cookie, 2));
+    int is_secure = PyObject_IsTrue(PyTuple_GET_ITEM(cookie, 4));
+    long long expiration = PyLong_AsLongLong(PyTuple_GET_ITEM(cookie, 5));
+    if(http_only < 0 || include_subdomains < 0 || is_secure < 0 || (expiration == -1 && PyErr_Occurred())) {
+        return NULL;
+    }
+    size_t needed = sizeof("#HttpOnly_\tFALSE\t\tFALSE\t-9223372036854775808\t\t");
+    for(int i = 0; i < 4; i++) {
+        if((text[i] = request_text(PyTuple_GET_ITEM(cookie, text_items[i]), &lens[i], &temps[i])) == NULL) {
+            goto done;
+        }
+        needed += lens[i];
+    }
+    if(needed > *size) {
+        *line = (char *)realloc(*line, needed);
+        *size = needed;
+    }
+    snprintf(*line, needed, "%s%.*s\t%s\t%.*s\t%s\t%lld\t%.*s\t%.*s", http_only ? "#HttpOnly_" : "",
+             (int)lens[0], text[0], include_subdomains ? "TRUE" : "FALSE", (int)lens[1], text[1],
+             is_secure ? "TRUE" : "FALSE", expiration, (int)lens[2], text[2], (int)lens[3], text[3]);
+    rtn = *line;
+    done:
+    for(int i = 0; i < 4; i++) {
+        Py_XDECREF(temps[i]);
+    }
+    return rtn;
+}
+
+/* Add tuples as get_cookies gives them, acurl.Cookie objects or curl's cookie lines to the jar in
+ * one call, each is parsed by curl under the cookie lock */
+
+static PyObject *
+Session_add_cookies(Session *self, PyObject *cookies)
+{
+    ENTER();
+    CURL *curl = jar_attach(session_share(self));
+    if(curl == NULL) {
+        EXIT();
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(cookies, "cookies should be a sequence of tuples, Cookie, str or bytes");
+    if(seq == NULL) {
+        EXIT();
+        return NULL;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    bool ok = true;
+    for(Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        PyObject *temp = NULL;
+        const char *text = NULL;
+        Py_ssize_t len;
+        bool tuple = PyTuple_Check(item) && PyTuple_GET_SIZE(item) == 8;
+        if(tuple) {
+            text = cookie_tuple_line(item, &line, &line_size);
+        }
+        else if(PyUnicode_Check(item) || PyBytes_Check(item)) {
+            text = request_text(item, &len, &temp);
+        }
+        else if((temp = PyObject_CallMethodObjArgs(item, str_format, NULL)) != NULL && PyUnicode_Check(temp)) {
+            text = PyUnicode_AsUTF8(temp);
+        }
+        if(text == NULL) {
+            Py_XDECREF(temp);
+            if(!PyErr_Occurred() || !tuple) {
+                PyErr_Clear();
+                PyErr_SetString(PyExc_ValueError, "cookies should be a sequence of tuples, Cookie, str or bytes");
+            }
+            ok = false;
+            break;
+        }
+        curl_easy_setopt(curl, CURLOPT_COOKIELIST, text);
+        Py_XDECREF(temp);
+    }
+    free(line);
+    Py_DECREF(seq);
+    EXIT();
+    if(!ok) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Session_erase_cookies(Session *self, PyObject *args)
+{
+    int session_only = 0;
+    if(!PyArg_ParseTuple(args, "|p", &session_only)) {
+        return NULL;
+    }
+    CURL *curl = jar_attach(session_share(self));
+    if(curl == NULL) {
+        return NULL;
+    }
+    curl_easy_setopt(curl, CURLOPT_COOKIELIST, session_only ? "SESS" : "ALL");
+    Py_RETURN_NONE;
+}
+
+
+/* Have the loop thread unpause a transfer, once however many times it is asked before it gets to it */
+
+static void request_resume(EventLoop *loop, AcRequestData *rd)
+{
+    if(__atomic_exchange_n(&rd->stream_resuming, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    __atomic_add_fetch(&rd->refs, 1, __ATOMIC_RELAXED);
+    stack_push(&loop->resumed_streams, &rd->resume);
+    if(loop->asyncio_loop != NULL) {
+        resume_streams(loop);
+        completion_queue_drain(loop->completions);
+    }
+    else {
+        doorbell_ring(&loop->req_in_doorbell);
+    }
+}
+
+
+/* The reader of a streamed request has read nbytes of what it was handed, resume the transfer if
+ * it was paused and enough has been read */
+
+static PyObject *
+Session_consumed(Session *self, PyObject *args)
+{
+    ENTER();
+    PyObject *handle;
+    long long nbytes;
+    if(!PyArg_ParseTuple(args, "OL", &handle, &nbytes)) {
+        EXIT();
+        return NULL;
+    }
+    AcRequestData *rd = session_request_get(self, handle);
+    if(rd == NULL || rd->stream == NULL) {
+        EXIT();
+        if(PyErr_Occurred()) {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+    __atomic_sub_fetch(&rd->stream_unconsumed, nbytes, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&rd->stream_paused, __ATOMIC_SEQ_CST) && stream_can_resume(rd)) {
+        request_resume(self->loop, rd);
+    }
+    EXIT();
+    Py_RETURN_NONE;
+}
+
+
+/* Push the next chunk of a request body made with upload=, None after the last one. Returns True
+ * when the feeder should wait for its _on_drained before pushing more, False when it can go on
+ * and None once the request is over */
+
+static PyObject *
+Session_upload(Session *self, PyObject *args)
+{
+    ENTER();
+    PyObject *handle;
+    PyObject *data;
+    if(!PyArg_ParseTuple(args, "OO", &handle, &data)) {
+        EXIT();
+        return NULL;
+    }
+    AcRequestData *rd = session_request_get(self, handle);
+    if(rd == NULL || rd->upload != UPLOAD_CHUNKS || __atomic_load_n(&rd->upload_eof, __ATOMIC_RELAXED)) {
+        EXIT();
+        if(PyErr_Occurred()) {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+    long long queued = 0;
+    if(data == Py_None) {
+        __atomic_store_n(&rd->upload_eof, 1, __ATOMIC_RELEASE);
+    }
+    else {
+        Py_buffer view;
+        if(PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) < 0) {
+            EXIT();
+            return NULL;
+        }
+        if(view.len == 0) {
+            PyBuffer_Release(&view);
+            EXIT();
+            Py_RETURN_FALSE;
+        }
+        UploadChunk *chunk = (UploadChunk *)malloc(sizeof(UploadChunk) + view.len);
+        chunk->len = view.len;
+        memcpy(chunk->data, view.buf, view.len);
+        PyBuffer_Release(&view);
+        queued = __atomic_add_fetch(&rd->upload_queued, (long long)chunk->len, __ATOMIC_SEQ_CST);
+        stack_push(&rd->upload_pushed, &chunk->node);
+    }
+    bool wait = false;
+    if(queued > UPLOAD_HIGH_WATER) {
+        __atomic_store_n(&rd->upload_waiting, 1, __ATOMIC_SEQ_CST);
+        /* Unless the loop thread sent enough before seeing the flag, it will call _on_drained */
+        wait = !(__atomic_load_n(&rd->upload_queued, __ATOMIC_SEQ_CST) <= UPLOAD_HIGH_WATER / 2 &&
+                 __atomic_exchange_n(&rd->upload_waiting, 0, __ATOMIC_SEQ_CST));
+    }
+    /* Pairs with the fence in upload_callback between pausing and looking at the queue again.
+     * Last, driven from asyncio resuming can complete the request and free rd */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&rd->upload_paused, __ATOMIC_SEQ_CST)) {
+        request_resume(self->loop, rd);
+    }
+    EXIT();
+    return PyBool_FromLong(wait);
+}
+
+
 static PyMethodDef Session_methods[] = {
-    {"request", (PyCFunction)Session_request, METH_VARARGS | METH_KEYWORDS, "Send a request"},
+    {"request", (PyCFunction)(void(*)(void))Session_request, METH_FASTCALL | METH_KEYWORDS, "Send a request, returns its handle for cancel, consumed and upload"},
+    {"cancel", (PyCFunction)Session_cancel, METH_O, "Cancel the request of a handle from request, returns False if it has already completed"},
+    {"consumed", (PyCFunction)Session_consumed, METH_VARARGS, "Tell a streamed request how many more bytes of its body have been read"},
+    {"upload", (PyCFunction)Session_upload, METH_VARARGS, "Push the next chunk of a request body made with upload=, None after the last"},
+    {"get_stats", (PyCFunction)Session_get_stats, METH_NOARGS, "Get the session's requests in flight and bytes received and not released yet"},
+    {"get_cookies", (PyCFunction)Session_get_cookies, METH_NOARGS, "Get the cookie jar as (http_only, domain, include_subdomains, path, is_secure, expiration, name, value) tuples"},
+    {"add_cookies", (PyCFunction)Session_add_cookies, METH_O, "Add a sequence of cookie tuples, Cookie objects or Netscape cookie lines to the jar"},
+    {"erase_cookies", (PyCFunction)Session_erase_cookies, METH_VARARGS, "Erase every cookie, or only the session cookies when session_only is true"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -1154,16 +4689,50 @@ PyInit__acurl(void)
     if (PyType_Ready(&ResponseType) < 0)
         return NULL;
 
+    if (PyType_Ready(&CompletionQueueType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&HeadersType) < 0)
+        return NULL;
+
     m = PyModule_Create(&_acurl_module);
 
     if(m != NULL) {
-        curl_global_init(CURL_GLOBAL_ALL); // init curl library
+        curl_global_init_mem(CURL_GLOBAL_ALL, curl_memory_malloc, curl_memory_free, curl_memory_realloc,
+                             curl_memory_strdup, curl_memory_calloc); // init curl library
+        str_set_result = PyUnicode_InternFromString("set_result");
+        str_set_exception = PyUnicode_InternFromString("set_exception");
+        str_cancelled = PyUnicode_InternFromString("cancelled");
+        str_add_reader = PyUnicode_InternFromString("add_reader");
+        str_remove_reader = PyUnicode_InternFromString("remove_reader");
+        str_add_writer = PyUnicode_InternFromString("add_writer");
+        str_remove_writer = PyUnicode_InternFromString("remove_writer");
+        str_call_later = PyUnicode_InternFromString("call_later");
+        str_call_soon = PyUnicode_InternFromString("call_soon");
+        str_cancel = PyUnicode_InternFromString("cancel");
+        str_on_headers = PyUnicode_InternFromString("_on_headers");
+        str_on_data = PyUnicode_InternFromString("_on_data");
+        str_on_drained = PyUnicode_InternFromString("_on_drained");
+        str_format = PyUnicode_InternFromString("format");
+        for(int i = 0; i < REQUEST_ARGS; i++) {
+            request_kwnames[i] = PyUnicode_InternFromString(request_kwlist[i]);
+        }
+        RequestError = PyErr_NewException("_acurl.RequestError", NULL, NULL);
+        Py_INCREF(RequestError);
+        PyModule_AddObject(m, "RequestError", RequestError);
+        RequestTimeout = PyErr_NewException("_acurl.RequestTimeout", RequestError, NULL);
+        Py_INCREF(RequestTimeout);
+        PyModule_AddObject(m, "RequestTimeout", RequestTimeout);
         Py_INCREF(&SessionType);
         PyModule_AddObject(m, "Session", (PyObject *)&SessionType);
         Py_INCREF(&EventLoopType);
         PyModule_AddObject(m, "EventLoop", (PyObject *)&EventLoopType);
         Py_INCREF(&ResponseType);
         PyModule_AddObject(m, "Response", (PyObject *)&ResponseType);
+        Py_INCREF(&CompletionQueueType);
+        PyModule_AddObject(m, "CompletionQueue", (PyObject *)&CompletionQueueType);
+        Py_INCREF(&HeadersType);
+        PyModule_AddObject(m, "Headers", (PyObject *)&HeadersType);
     }
     
     return m;
@@ -61,7 +61,9 @@
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
-    #ifdef HAVE_EPOLL
+    #if defined(HAVE_IO_URING)
+    #include "ae_uring.c" /* includes ae_epoll.c as the fallback */
+    #elif defined(HAVE_EPOLL)
     #include "ae_epoll.c"
     #else
         #ifdef HAVE_KQUEUE
@@ -73,6 +75,10 @@
 #endif
 
 aeEventLoop *aeCreateEventLoop(int setsize) {
+    return aeCreateEventLoopWithFlags(setsize, 0);
+}
+
+aeEventLoop *aeCreateEventLoopWithFlags(int setsize, int flags) {
     aeEventLoop *eventLoop;
     int i;
 
@@ -81,12 +87,22 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->fired = zmalloc(sizeof(aeFiredEvent)*setsize);
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timeHeap = NULL;
+    eventLoop->timeHeapSize = 0;
+    eventLoop->timeHeapCap = 0;
+    eventLoop->timeSlots = NULL;
+    eventLoop->timeSlotsNextFree = NULL;
+    eventLoop->timeSlotsCap = 0;
+    eventLoop->timeSlotsFree = -1;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->flags = flags;
+    eventLoop->statRegistrations = 0;
+    eventLoop->statPolls = 0;
+    eventLoop->statFiredEvents = 0;
+    eventLoop->apiname = aeApiName(); /* a backend with a fallback overrides this */
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
@@ -134,6 +150,17 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int j;
+
+    for (j = 0; j < eventLoop->timeHeapSize; j++) {
+        aeTimeEvent *te = eventLoop->timeHeap[j];
+        if (te->finalizerProc)
+            te->finalizerProc(eventLoop, te->clientData);
+        zfree(te);
+    }
+    zfree(eventLoop->timeHeap);
+    zfree(eventLoop->timeSlots);
+    zfree(eventLoop->timeSlotsNextFree);
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
@@ -172,6 +199,7 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 
     aeApiDelEvent(eventLoop, fd, mask);
     fe->mask = fe->mask & (~mask);
+    if (!(fe->mask & (AE_READABLE|AE_WRITABLE))) fe->mask = AE_NONE;
     if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
         /* Update the max fd */
         int j;
@@ -183,6 +211,56 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 	DEBUG_PRINT("fd=%d fe->mask=%d", fd, fe->mask);
 }
 
+/* Make mask (AE_NONE to stop monitoring) the complete set of events monitored
+ * for fd. Unlike an aeCreateFileEvent() plus aeDeleteFileEvent() pair this is
+ * a single polling API call when the backend implements aeApiModEvent(), and
+ * none at all when the mask doesn't change. */
+int aeSetFileEvents(aeEventLoop *eventLoop, int fd, int mask,
+        aeFileProc *proc, void *clientData)
+{
+    aeFileEvent *fe;
+    int oldmask;
+
+    if (!(mask & (AE_READABLE|AE_WRITABLE))) mask = AE_NONE;
+    if (fd >= eventLoop->setsize) {
+        if (mask == AE_NONE) return AE_OK;
+        aeResizeSetSize(eventLoop, (int)(fd * 1.5) + 1);
+        if (fd >= eventLoop->setsize) return AE_ERR;
+    }
+    fe = &eventLoop->events[fd];
+    oldmask = fe->mask;
+    if (mask != oldmask) {
+#ifdef AE_API_HAS_MOD
+        if (aeApiModEvent(eventLoop, fd, oldmask, mask) == -1)
+            return AE_ERR;
+#else
+        int addmask = mask & ~oldmask, delmask = oldmask & ~mask;
+
+        if (addmask) {
+            if (aeApiAddEvent(eventLoop, fd, addmask) == -1)
+                return AE_ERR;
+            fe->mask |= addmask;
+        }
+        if (delmask) aeApiDelEvent(eventLoop, fd, delmask);
+#endif
+    }
+    fe->mask = mask;
+    if (mask & AE_READABLE) fe->rfileProc = proc;
+    if (mask & AE_WRITABLE) fe->wfileProc = proc;
+    fe->clientData = clientData;
+    if (mask != AE_NONE && fd > eventLoop->maxfd) {
+        eventLoop->maxfd = fd;
+    } else if (mask == AE_NONE && fd == eventLoop->maxfd) {
+        int j;
+
+        for (j = eventLoop->maxfd-1; j >= 0; j--)
+            if (eventLoop->events[j].mask != AE_NONE) break;
+        eventLoop->maxfd = j;
+    }
+	DEBUG_PRINT("fd=%d fe->mask=%d", fd, fe->mask);
+    return AE_OK;
+}
+
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
     if (fd >= eventLoop->setsize) return 0;
     aeFileEvent *fe = &eventLoop->events[fd];
@@ -190,158 +268,225 @@ int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
     return fe->mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
-{
-    struct timeval tv;
+long long aeMonotonicNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Time events are kept in a binary min-heap ordered by when, so finding the
+ * nearest timer is O(1) and adding or removing one is O(log(N)). The id of a
+ * time event encodes the slot holding it in timeSlots (low 32 bits) above a
+ * sequence number, so ids keep increasing and deleting by id needs no search. */
+
+#define AE_TIME_SLOT(id) ((int)((id) & 0xffffffffLL))
 
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    return a->when < b->when || (a->when == b->when && a->id < b->id);
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+static void aeTimeHeapSet(aeEventLoop *eventLoop, int index, aeTimeEvent *te) {
+    eventLoop->timeHeap[index] = te;
+    te->heapIndex = index;
+}
+
+static void aeTimeHeapSiftUp(aeEventLoop *eventLoop, int index) {
+    aeTimeEvent *te = eventLoop->timeHeap[index];
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+    while (index > 0) {
+        int parent = (index-1)/2;
+        if (!aeTimeEventBefore(te, eventLoop->timeHeap[parent])) break;
+        aeTimeHeapSet(eventLoop, index, eventLoop->timeHeap[parent]);
+        index = parent;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    aeTimeHeapSet(eventLoop, index, te);
 }
 
-long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
+static void aeTimeHeapSiftDown(aeEventLoop *eventLoop, int index) {
+    aeTimeEvent *te = eventLoop->timeHeap[index];
+    int size = eventLoop->timeHeapSize;
+
+    while (1) {
+        int child = index*2+1;
+        if (child >= size) break;
+        if (child+1 < size &&
+            aeTimeEventBefore(eventLoop->timeHeap[child+1], eventLoop->timeHeap[child]))
+            child++;
+        if (!aeTimeEventBefore(eventLoop->timeHeap[child], te)) break;
+        aeTimeHeapSet(eventLoop, index, eventLoop->timeHeap[child]);
+        index = child;
+    }
+    aeTimeHeapSet(eventLoop, index, te);
+}
+
+static int aeTimeHeapInsert(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->timeHeapSize == eventLoop->timeHeapCap) {
+        int cap = eventLoop->timeHeapCap ? eventLoop->timeHeapCap*2 : 64;
+        aeTimeEvent **heap = zrealloc(eventLoop->timeHeap, sizeof(aeTimeEvent*)*cap);
+        if (heap == NULL) return AE_ERR;
+        eventLoop->timeHeap = heap;
+        eventLoop->timeHeapCap = cap;
+    }
+    aeTimeHeapSet(eventLoop, eventLoop->timeHeapSize++, te);
+    aeTimeHeapSiftUp(eventLoop, te->heapIndex);
+    return AE_OK;
+}
+
+static void aeTimeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int index = te->heapIndex;
+    aeTimeEvent *last = eventLoop->timeHeap[--eventLoop->timeHeapSize];
+
+    te->heapIndex = -1;
+    if (last == te) return;
+    aeTimeHeapSet(eventLoop, index, last);
+    if (index > 0 && aeTimeEventBefore(last, eventLoop->timeHeap[(index-1)/2]))
+        aeTimeHeapSiftUp(eventLoop, index);
+    else
+        aeTimeHeapSiftDown(eventLoop, index);
+}
+
+static int aeTimeSlotAcquire(aeEventLoop *eventLoop) {
+    int slot;
+
+    if (eventLoop->timeSlotsFree == -1) {
+        int j, cap = eventLoop->timeSlotsCap ? eventLoop->timeSlotsCap*2 : 64;
+        aeTimeEvent **slots = zrealloc(eventLoop->timeSlots, sizeof(aeTimeEvent*)*cap);
+        int *nextFree;
+
+        if (slots == NULL) return -1;
+        eventLoop->timeSlots = slots;
+        nextFree = zrealloc(eventLoop->timeSlotsNextFree, sizeof(int)*cap);
+        if (nextFree == NULL) return -1;
+        eventLoop->timeSlotsNextFree = nextFree;
+        for (j = eventLoop->timeSlotsCap; j < cap; j++) {
+            eventLoop->timeSlots[j] = NULL;
+            eventLoop->timeSlotsNextFree[j] = j+1 < cap ? j+1 : -1;
+        }
+        eventLoop->timeSlotsFree = eventLoop->timeSlotsCap;
+        eventLoop->timeSlotsCap = cap;
+    }
+    slot = eventLoop->timeSlotsFree;
+    eventLoop->timeSlotsFree = eventLoop->timeSlotsNextFree[slot];
+    return slot;
+}
+
+static void aeTimeSlotRelease(aeEventLoop *eventLoop, long long id) {
+    int slot = AE_TIME_SLOT(id);
+
+    eventLoop->timeSlots[slot] = NULL;
+    eventLoop->timeSlotsNextFree[slot] = eventLoop->timeSlotsFree;
+    eventLoop->timeSlotsFree = slot;
+}
+
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (te->id != AE_DELETED_EVENT_ID)
+        aeTimeSlotRelease(eventLoop, te->id);
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
+}
+
+long long aeCreateTimeEventNs(aeEventLoop *eventLoop, long long nanoseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
 {
-    long long id = eventLoop->timeEventNextId++;
     aeTimeEvent *te;
+    int slot;
 
     te = zmalloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
-    te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    if ((slot = aeTimeSlotAcquire(eventLoop)) == -1) {
+        zfree(te);
+        return AE_ERR;
+    }
+    te->id = (eventLoop->timeEventNextId++ << 32) | slot;
+    te->when = aeMonotonicNs() + nanoseconds;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
-    return id;
+    te->next = NULL;
+    if (aeTimeHeapInsert(eventLoop, te) == AE_ERR) {
+        aeTimeSlotRelease(eventLoop, te->id);
+        zfree(te);
+        return AE_ERR;
+    }
+    eventLoop->timeSlots[slot] = te;
+    return te->id;
+}
+
+long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
+        aeTimeProc *proc, void *clientData,
+        aeEventFinalizerProc *finalizerProc)
+{
+    return aeCreateTimeEventNs(eventLoop, milliseconds*1000000LL, proc,
+            clientData, finalizerProc);
 }
 
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            te->id = AE_DELETED_EVENT_ID;
-            return AE_OK;
-        }
-        te = te->next;
+    int slot = AE_TIME_SLOT(id);
+    aeTimeEvent *te;
+
+    if (id < 0 || slot >= eventLoop->timeSlotsCap) return AE_ERR;
+    te = eventLoop->timeSlots[slot];
+    if (te == NULL || te->id != id) return AE_ERR; /* NO event with the specified ID found */
+    if (te->heapIndex != -1) {
+        aeTimeHeapRemove(eventLoop, te);
+        aeFreeTimeEvent(eventLoop, te);
+    } else {
+        /* Currently being processed, processTimeEvents() frees it. */
+        aeTimeSlotRelease(eventLoop, te->id);
+        te->id = AE_DELETED_EVENT_ID;
     }
-    return AE_ERR; /* NO event with the specified ID found */
+    return AE_OK;
 }
 
 /* Search the first timer to fire.
  * This operation is useful to know how many time the select can be
  * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
+ * If there are no timers NULL is returned. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    return eventLoop->timeHeapSize ? eventLoop->timeHeap[0] : NULL;
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
-    aeTimeEvent *te, *prev;
-    long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
-    }
-    eventLoop->lastTime = now;
-
-    prev = NULL;
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
-        long long id;
-
-        /* Remove events scheduled for deletion. */
-        if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            te = next;
-            continue;
-        }
+    aeTimeEvent *te, *deferred = NULL;
+    long long maxId = (eventLoop->timeEventNextId << 32) - 1;
+    long long now = aeMonotonicNs();
+
+    while (eventLoop->timeHeapSize && eventLoop->timeHeap[0]->when <= now) {
+        int retval;
 
+        te = eventLoop->timeHeap[0];
+        aeTimeHeapRemove(eventLoop, te);
         /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
+         * this iteration, they are put back once we are done. */
         if (te->id > maxId) {
-            te = te->next;
+            te->next = deferred;
+            deferred = te;
             continue;
         }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                te->id = AE_DELETED_EVENT_ID;
-            }
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        processed++;
+        if (retval != AE_NOMORE && te->id != AE_DELETED_EVENT_ID) {
+            te->when = aeMonotonicNs() + retval*1000000LL;
+            aeTimeHeapInsert(eventLoop, te);
+        } else {
+            aeFreeTimeEvent(eventLoop, te);
         }
-        prev = te;
-        te = te->next;
+    }
+    while (deferred) {
+        te = deferred;
+        deferred = te->next;
+        te->next = NULL;
+        if (te->id == AE_DELETED_EVENT_ID)
+            aeFreeTimeEvent(eventLoop, te);
+        else
+            aeTimeHeapInsert(eventLoop, te);
     }
     return processed;
 }
@@ -379,20 +524,15 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
             shortest = aeSearchNearestTimer(eventLoop);
         if (shortest) {
-            long now_sec, now_ms;
-
-            aeGetTime(&now_sec, &now_ms);
             tvp = &tv;
 
-            /* How many milliseconds we need to wait for the next
-             * time event to fire? */
-            long long ms =
-                (shortest->when_sec - now_sec)*1000 +
-                shortest->when_ms - now_ms;
+            /* How many microseconds we need to wait for the next
+             * time event to fire? Rounded up so we never wake early. */
+            long long us = (shortest->when - aeMonotonicNs() + 999)/1000;
 
-            if (ms > 0) {
-                tvp->tv_sec = ms/1000;
-                tvp->tv_usec = (ms % 1000)*1000;
+            if (us > 0) {
+                tvp->tv_sec = us/1000000;
+                tvp->tv_usec = us%1000000;
             } else {
                 tvp->tv_sec = 0;
                 tvp->tv_usec = 0;
@@ -410,6 +550,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
         }
         numevents = aeApiPoll(eventLoop, tvp);
+        eventLoop->statPolls++;
+        if (numevents > 0) eventLoop->statFiredEvents += numevents;
         for (j = 0; j < numevents; j++) {
             aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
             int mask = eventLoop->fired[j].mask;
@@ -474,19 +616,14 @@ char *aeGetApiName(void) {
     return aeApiName();
 }
 
+char *aeGetEventLoopApiName(aeEventLoop *eventLoop) {
+    return eventLoop->apiname;
+}
+
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
 
 int aeHasEvents(aeEventLoop *eventLoop) {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    int found_timed_event = 0;
-    while(te) {
-        if(te->id != AE_DELETED_EVENT_ID) {
-            found_timed_event = 1;
-            break;
-        }
-        te = te->next;
-    }
-    return found_timed_event || eventLoop->maxfd != -1;
+    return eventLoop->timeHeapSize > 0 || eventLoop->maxfd != -1;
 }
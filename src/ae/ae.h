@@ -41,12 +41,16 @@
 #define AE_NONE 0
 #define AE_READABLE 1
 #define AE_WRITABLE 2
+#define AE_EDGE 4 /* hint: the handler drains the fd, so edge notification is enough */
 
 #define AE_FILE_EVENTS 1
 #define AE_TIME_EVENTS 2
 #define AE_ALL_EVENTS (AE_FILE_EVENTS|AE_TIME_EVENTS)
 #define AE_DONT_WAIT 4
 
+/* aeCreateEventLoopWithFlags() flags */
+#define AE_FLAG_IO_URING 1 /* use io_uring if the kernel supports it */
+
 #define AE_NOMORE -1
 #define AE_DELETED_EVENT_ID -1
 
@@ -63,7 +67,7 @@ typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
 
 /* File event structure */
 typedef struct aeFileEvent {
-    int mask; /* one of AE_(READABLE|WRITABLE) */
+    int mask; /* one of AE_(READABLE|WRITABLE), plus AE_EDGE */
     aeFileProc *rfileProc;
     aeFileProc *wfileProc;
     void *clientData;
@@ -72,12 +76,12 @@ typedef struct aeFileEvent {
 /* Time event structure */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* CLOCK_MONOTONIC nanoseconds */
+    int heapIndex; /* position in the timer heap, -1 while not queued */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *next;
+    struct aeTimeEvent *next; /* used while processing */
 } aeTimeEvent;
 
 /* A fired event */
@@ -93,31 +97,49 @@ typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
     long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeHeap; /* Binary min-heap of time events ordered by when */
+    int timeHeapSize;
+    int timeHeapCap;
+    aeTimeEvent **timeSlots; /* Time events by the slot encoded in their id */
+    int *timeSlotsNextFree;
+    int timeSlotsCap;
+    int timeSlotsFree; /* head of the free slot list, -1 if none */
     int stop;
     void *apidata; /* This is used for polling API specific data */
+    int flags; /* AE_FLAG_* the loop was created with */
+    char *apiname; /* polling API actually in use */
+    long long statRegistrations; /* interest changes handed to the polling API (epoll_ctl calls, io_uring poll SQEs) */
+    long long statPolls; /* calls to the polling API to wait for events */
+    long long statFiredEvents; /* file events it returned */
     aeBeforeSleepProc *beforesleep;
 } aeEventLoop;
 
 /* Prototypes */
 aeEventLoop *aeCreateEventLoop(int setsize);
+aeEventLoop *aeCreateEventLoopWithFlags(int setsize, int flags);
 void aeDeleteEventLoop(aeEventLoop *eventLoop);
 void aeStop(aeEventLoop *eventLoop);
 int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData);
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
+int aeSetFileEvents(aeEventLoop *eventLoop, int fd, int mask,
+        aeFileProc *proc, void *clientData);
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd);
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
+long long aeCreateTimeEventNs(aeEventLoop *eventLoop, long long nanoseconds,
+        aeTimeProc *proc, void *clientData,
+        aeEventFinalizerProc *finalizerProc);
+long long aeMonotonicNs(void);
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
 int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
+char *aeGetEventLoopApiName(aeEventLoop *eventLoop);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
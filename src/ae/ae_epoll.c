@@ -30,17 +30,45 @@
 
 
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+
+/* epoll_wait() batch size. It starts small and doubles whenever a wait fills
+ * it, up to setsize, then shrinks back after a long run of waits that used
+ * less than a quarter of it. */
+#define AE_EPOLL_MIN_BATCH 64
+#define AE_EPOLL_SHRINK_AFTER 1024
+
+#define AE_API_HAS_MOD
 
 typedef struct aeApiState {
     int epfd;
     struct epoll_event *events;
+    int batch; /* size of events */
+    int underused; /* consecutive waits that returned less than batch/4 events */
 } aeApiState;
 
+static void aeApiSetBatch(aeApiState *state, int batch) {
+    state->events = zrealloc(state->events, sizeof(struct epoll_event)*batch);
+    state->batch = batch;
+    state->underused = 0;
+}
+
+static int aeApiEpollEvents(int mask) {
+    int events = 0;
+
+    if (mask & AE_READABLE) events |= EPOLLIN;
+    if (mask & AE_WRITABLE) events |= EPOLLOUT;
+    if (mask & AE_EDGE) events |= EPOLLET;
+    return events;
+}
+
 static int aeApiCreate(aeEventLoop *eventLoop) {
     aeApiState *state = zmalloc(sizeof(aeApiState));
 
     if (!state) return -1;
-    state->events = zmalloc(sizeof(struct epoll_event)*eventLoop->setsize);
+    state->batch = eventLoop->setsize < AE_EPOLL_MIN_BATCH ? eventLoop->setsize : AE_EPOLL_MIN_BATCH;
+    state->underused = 0;
+    state->events = zmalloc(sizeof(struct epoll_event)*state->batch);
     if (!state->events) {
         zfree(state);
         return -1;
@@ -58,7 +86,7 @@ static int aeApiCreate(aeEventLoop *eventLoop) {
 static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
     aeApiState *state = eventLoop->apidata;
 
-    state->events = zrealloc(state->events, sizeof(struct epoll_event)*setsize);
+    if (state->batch > setsize) aeApiSetBatch(state, setsize);
     return 0;
 }
 
@@ -78,11 +106,10 @@ static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
     int op = eventLoop->events[fd].mask == AE_NONE ?
             EPOLL_CTL_ADD : EPOLL_CTL_MOD;
 
-    ee.events = 0;
     mask |= eventLoop->events[fd].mask; /* Merge old events */
-    if (mask & AE_READABLE) ee.events |= EPOLLIN;
-    if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+    ee.events = aeApiEpollEvents(mask);
     ee.data.fd = fd;
+    eventLoop->statRegistrations++;
     if (epoll_ctl(state->epfd,op,fd,&ee) == -1) return -1;
     return 0;
 }
@@ -92,11 +119,10 @@ static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
     struct epoll_event ee = {0}; /* avoid valgrind warning */
     int mask = eventLoop->events[fd].mask & (~delmask);
 
-    ee.events = 0;
-    if (mask & AE_READABLE) ee.events |= EPOLLIN;
-    if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+    ee.events = aeApiEpollEvents(mask);
     ee.data.fd = fd;
-    if (mask != AE_NONE) {
+    eventLoop->statRegistrations++;
+    if (mask & (AE_READABLE|AE_WRITABLE)) {
         epoll_ctl(state->epfd,EPOLL_CTL_MOD,fd,&ee);
     } else {
         /* Note, Kernel < 2.6.9 requires a non null event pointer even for
@@ -105,12 +131,47 @@ static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
     }
 }
 
+/* Go from oldmask to mask with a single epoll_ctl(). */
+static int aeApiModEvent(aeEventLoop *eventLoop, int fd, int oldmask, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    struct epoll_event ee = {0}; /* avoid valgrind warning */
+    int op = oldmask == AE_NONE ? EPOLL_CTL_ADD :
+            (mask == AE_NONE ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+
+    ee.events = aeApiEpollEvents(mask);
+    ee.data.fd = fd;
+    eventLoop->statRegistrations++;
+    if (epoll_ctl(state->epfd,op,fd,&ee) == -1 && op != EPOLL_CTL_DEL) return -1;
+    return 0;
+}
+
+/* epoll_pwait2() takes a timespec, so timers keep their sub-millisecond
+ * precision. Kernels older than 5.11 get epoll_wait() with the timeout rounded
+ * up to the next millisecond, rather than down which would spin. */
+static int aeApiWait(aeApiState *state, int maxevents, struct timeval *tvp) {
+#ifdef SYS_epoll_pwait2
+    static int have_pwait2 = 1;
+
+    if (tvp && have_pwait2) {
+        struct timespec ts;
+        int retval;
+
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        retval = syscall(SYS_epoll_pwait2,state->epfd,state->events,maxevents,&ts,NULL,0);
+        if (retval != -1 || errno != ENOSYS) return retval;
+        have_pwait2 = 0;
+    }
+#endif
+    return epoll_wait(state->epfd,state->events,maxevents,
+            tvp ? (tvp->tv_sec*1000 + (tvp->tv_usec+999)/1000) : -1);
+}
+
 static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
     aeApiState *state = eventLoop->apidata;
     int retval, numevents = 0;
 
-    retval = epoll_wait(state->epfd,state->events,eventLoop->setsize,
-            tvp ? (tvp->tv_sec*1000 + tvp->tv_usec/1000) : -1);
+    retval = aeApiWait(state,state->batch,tvp);
     if (retval > 0) {
         int j;
 
@@ -127,6 +188,14 @@ static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
             eventLoop->fired[j].mask = mask;
         }
     }
+    if (retval == state->batch && state->batch < eventLoop->setsize) {
+        aeApiSetBatch(state, state->batch*2 < eventLoop->setsize ? state->batch*2 : eventLoop->setsize);
+    } else if (retval < state->batch/4 && state->batch > AE_EPOLL_MIN_BATCH &&
+               ++state->underused == AE_EPOLL_SHRINK_AFTER) {
+        aeApiSetBatch(state, state->batch/2);
+    } else if (retval >= state->batch/4) {
+        state->underused = 0;
+    }
     return numevents;
 }
 
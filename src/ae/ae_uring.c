@@ -0,0 +1,436 @@
+/* Linux io_uring based ae.c module, selected at runtime with AE_FLAG_IO_URING.
+ *
+ * Interest changes only mark the fd dirty. Just before waiting the final mask
+ * of every dirty fd is turned into at most one IORING_OP_POLL_REMOVE and one
+ * IORING_OP_POLL_ADD, and all of them are submitted by the same io_uring_enter()
+ * call that waits, so an fd that flips between readable and writable costs no
+ * extra system call. Completions are reaped straight from the mapped CQ ring.
+ *
+ * Polls are one shot and re-armed after they fire, which keeps the level
+ * triggered behaviour the rest of ae expects. Fds registered with AE_EDGE use
+ * multishot polls where the kernel supports them.
+ *
+ * The epoll module is compiled in as well. If io_uring wasn't requested, or
+ * the kernel lacks what we need (IORING_FEAT_EXT_ARG, Linux 5.11) or forbids
+ * io_uring, the event loop uses epoll instead.
+ */
+
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <endian.h>
+
+#define aeApiState aeEpollState
+#define aeApiCreate aeEpollCreate
+#define aeApiResize aeEpollResize
+#define aeApiFree aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiModEvent aeEpollModEvent
+#define aeApiEpollEvents aeEpollEvents
+#define aeApiSetBatch aeEpollSetBatch
+#define aeApiWait aeEpollWait
+#define aeApiPoll aeEpollPoll
+#define aeApiName aeEpollName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiModEvent
+#undef aeApiEpollEvents
+#undef aeApiSetBatch
+#undef aeApiWait
+#undef aeApiPoll
+#undef aeApiName
+
+#define AE_URING_ENTRIES 1024
+#define AE_URING_IGNORE ((unsigned long long)-1) /* user_data of POLL_REMOVE requests */
+
+typedef struct aeUringFd {
+    int armed;        /* AE_(READABLE|WRITABLE) of the poll in flight, AE_NONE if none */
+    int multishot;
+    unsigned gen;     /* bumped on every new poll so completions of old ones can be told apart */
+    int dirty;
+    int reset;        /* interest dropped to none since the poll was armed, the fd may be a new file */
+    long long firedIteration;
+    int firedIndex;
+} aeUringFd;
+
+typedef struct aeUringState {
+    int ringfd;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit;
+    aeUringFd *fds;
+    int *dirty;
+    int ndirty;
+    int multishot; /* cleared if the kernel rejects IORING_POLL_ADD_MULTI */
+    long long iteration;
+} aeUringState;
+
+typedef struct aeApiState {
+    int uring; /* which of the two states below is in use */
+    union {
+        aeEpollState *epoll;
+        aeUringState *uring;
+    } u;
+} aeApiState;
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeUringEnter(aeUringState *state, unsigned submit, unsigned wait, struct timeval *tvp) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG/8;
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+    }
+    return (int)syscall(__NR_io_uring_enter, state->ringfd, submit, wait,
+            IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+static void aeUringFreeState(aeUringState *state) {
+    if (state->sqes) munmap(state->sqes, state->sqesSize);
+    if (state->cqRing && state->cqRing != state->sqRing) munmap(state->cqRing, state->cqRingSize);
+    if (state->sqRing) munmap(state->sqRing, state->sqRingSize);
+    if (state->ringfd != -1) close(state->ringfd);
+    zfree(state->fds);
+    zfree(state->dirty);
+    zfree(state);
+}
+
+static int aeUringResize(aeUringState *state, int oldsize, int setsize) {
+    int j;
+
+    state->fds = zrealloc(state->fds, sizeof(aeUringFd)*setsize);
+    state->dirty = zrealloc(state->dirty, sizeof(int)*setsize);
+    for (j = oldsize; j < setsize; j++) {
+        memset(&state->fds[j], 0, sizeof(aeUringFd));
+        state->fds[j].firedIteration = -1;
+    }
+    return 0;
+}
+
+static aeUringState *aeUringCreate(aeEventLoop *eventLoop) {
+    struct io_uring_params p;
+    aeUringState *state = zcalloc(sizeof(aeUringState));
+
+    if (!state) return NULL;
+    state->ringfd = -1;
+    memset(&p, 0, sizeof(p));
+#ifdef IORING_SETUP_SUBMIT_ALL
+    p.flags |= IORING_SETUP_SUBMIT_ALL;
+#endif
+#ifdef IORING_SETUP_COOP_TASKRUN
+    p.flags |= IORING_SETUP_COOP_TASKRUN;
+#endif
+    if ((state->ringfd = aeUringSetup(AE_URING_ENTRIES, &p)) == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        state->ringfd = aeUringSetup(AE_URING_ENTRIES, &p);
+    }
+    if (state->ringfd == -1 || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) goto err;
+
+    state->sqRingSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqRingSize > state->sqRingSize) state->sqRingSize = state->cqRingSize;
+        state->cqRingSize = state->sqRingSize;
+    }
+    state->sqRing = mmap(NULL, state->sqRingSize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQ_RING);
+    if (state->sqRing == MAP_FAILED) {
+        state->sqRing = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cqRing = state->sqRing;
+    } else {
+        state->cqRing = mmap(NULL, state->cqRingSize, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_CQ_RING);
+        if (state->cqRing == MAP_FAILED) {
+            state->cqRing = NULL;
+            goto err;
+        }
+    }
+    state->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqesSize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+    state->sqHead = (unsigned *)((char *)state->sqRing + p.sq_off.head);
+    state->sqTail = (unsigned *)((char *)state->sqRing + p.sq_off.tail);
+    state->sqMask = (unsigned *)((char *)state->sqRing + p.sq_off.ring_mask);
+    state->sqArray = (unsigned *)((char *)state->sqRing + p.sq_off.array);
+    state->cqHead = (unsigned *)((char *)state->cqRing + p.cq_off.head);
+    state->cqTail = (unsigned *)((char *)state->cqRing + p.cq_off.tail);
+    state->cqMask = (unsigned *)((char *)state->cqRing + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)((char *)state->cqRing + p.cq_off.cqes);
+    state->multishot = 1;
+    aeUringResize(state, 0, eventLoop->setsize);
+    return state;
+
+err:
+    aeUringFreeState(state);
+    return NULL;
+}
+
+/* Get a free SQE, submitting what is queued if the SQ ring is full. */
+static struct io_uring_sqe *aeUringGetSqe(aeUringState *state) {
+    unsigned tail = *state->sqTail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE) > *state->sqMask) {
+        aeUringEnter(state, state->toSubmit, 0, NULL);
+        state->toSubmit = 0;
+        if (tail - __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE) > *state->sqMask)
+            return NULL;
+    }
+    sqe = &state->sqes[tail & *state->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    state->sqArray[tail & *state->sqMask] = tail & *state->sqMask;
+    __atomic_store_n(state->sqTail, tail+1, __ATOMIC_RELEASE);
+    state->toSubmit++;
+    return sqe;
+}
+
+static unsigned long long aeUringUserData(int fd, unsigned gen) {
+    return ((unsigned long long)gen << 32) | (unsigned)fd;
+}
+
+static void aeUringMarkDirty(aeUringState *state, int fd) {
+    if (state->fds[fd].dirty) return;
+    state->fds[fd].dirty = 1;
+    state->dirty[state->ndirty++] = fd;
+}
+
+/* Bring the polls in flight in line with the interest mask of every dirty fd. */
+static void aeUringFlush(aeEventLoop *eventLoop, aeUringState *state) {
+    int j;
+
+    for (j = 0; j < state->ndirty; j++) {
+        int fd = state->dirty[j];
+        aeUringFd *f = &state->fds[fd];
+        int mask = eventLoop->events[fd].mask;
+        int wanted = mask & (AE_READABLE|AE_WRITABLE);
+        int multishot = (mask & AE_EDGE) && state->multishot;
+        struct io_uring_sqe *sqe;
+
+        if (!f->reset && f->armed == wanted && (!wanted || f->multishot == multishot)) {
+            f->dirty = 0;
+            continue;
+        }
+        /* On a full SQ ring the fd stays dirty, and in the list, until both are queued. */
+        if (f->armed != AE_NONE) {
+            if ((sqe = aeUringGetSqe(state)) == NULL) break;
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = aeUringUserData(fd, f->gen);
+            sqe->user_data = AE_URING_IGNORE;
+            f->armed = AE_NONE;
+            eventLoop->statRegistrations++;
+        }
+        f->gen++;
+        if (wanted != AE_NONE) {
+            if ((sqe = aeUringGetSqe(state)) == NULL) break;
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = 0;
+            if (wanted & AE_READABLE) sqe->poll32_events |= POLLIN;
+            if (wanted & AE_WRITABLE) sqe->poll32_events |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+            sqe->poll32_events = __swahw32(sqe->poll32_events);
+#endif
+            sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+            sqe->user_data = aeUringUserData(fd, f->gen);
+            f->armed = wanted;
+            f->multishot = multishot;
+            eventLoop->statRegistrations++;
+        }
+        f->dirty = 0;
+        f->reset = 0;
+    }
+    /* Anything left over (SQ ring exhausted) is retried on the next poll. */
+    if (j < state->ndirty) {
+        memmove(state->dirty, state->dirty+j, sizeof(int)*(state->ndirty-j));
+        state->ndirty -= j;
+    } else {
+        state->ndirty = 0;
+    }
+}
+
+static int aeUringReap(aeEventLoop *eventLoop, aeUringState *state) {
+    unsigned head = *state->cqHead;
+    unsigned tail = __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE);
+    int numevents = 0;
+
+    state->iteration++;
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cqMask];
+        int fd = (int)(cqe->user_data & 0xffffffff);
+        unsigned gen = (unsigned)(cqe->user_data >> 32);
+        aeUringFd *f;
+        int mask = 0;
+
+        if (cqe->user_data == AE_URING_IGNORE || fd >= eventLoop->setsize) continue;
+        f = &state->fds[fd];
+        if (gen != f->gen) continue; /* completion of a poll we replaced */
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            f->armed = AE_NONE;
+            aeUringMarkDirty(state, fd);
+        }
+        if (cqe->res < 0) {
+            if (cqe->res == -EINVAL && f->multishot) state->multishot = 0;
+            continue;
+        }
+        if (cqe->res & POLLIN) mask |= AE_READABLE;
+        if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+        if (cqe->res & POLLERR) mask |= AE_WRITABLE;
+        if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        if (f->firedIteration == state->iteration) {
+            eventLoop->fired[f->firedIndex].mask |= mask;
+            continue;
+        }
+        f->firedIteration = state->iteration;
+        f->firedIndex = numevents;
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cqHead, head, __ATOMIC_RELEASE);
+    return numevents;
+}
+
+static int aeUringPoll(aeEventLoop *eventLoop, aeUringState *state, struct timeval *tvp) {
+    int ready, wait;
+
+    aeUringFlush(eventLoop, state);
+    ready = *state->cqHead != __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE);
+    wait = !ready && !(tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0);
+    if (state->toSubmit || wait) {
+        aeUringEnter(state, state->toSubmit, wait, tvp);
+        state->toSubmit = 0;
+    }
+    return aeUringReap(eventLoop, state);
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zmalloc(sizeof(aeApiState));
+
+    if (!state) return -1;
+    state->uring = 0;
+    if ((eventLoop->flags & AE_FLAG_IO_URING) &&
+        (state->u.uring = aeUringCreate(eventLoop)) != NULL) {
+        state->uring = 1;
+        eventLoop->apidata = state;
+        eventLoop->apiname = "io_uring";
+        return 0;
+    }
+    if (aeEpollCreate(eventLoop) == -1) {
+        zfree(state);
+        return -1;
+    }
+    state->u.epoll = eventLoop->apidata;
+    eventLoop->apidata = state;
+    eventLoop->apiname = aeEpollName();
+    return 0;
+}
+
+/* The epoll functions find their own state in apidata, so swap it in while
+ * calling them. */
+#define AE_EPOLL_CALL(eventLoop, state, call) do { \
+    (eventLoop)->apidata = (state)->u.epoll; \
+    call; \
+    (eventLoop)->apidata = (state); \
+} while(0)
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    int retval;
+
+    if (state->uring) return aeUringResize(state->u.uring, eventLoop->setsize, setsize);
+    AE_EPOLL_CALL(eventLoop, state, retval = aeEpollResize(eventLoop, setsize));
+    return retval;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->uring) {
+        aeUringFreeState(state->u.uring);
+    } else {
+        AE_EPOLL_CALL(eventLoop, state, aeEpollFree(eventLoop));
+    }
+    zfree(state);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    int retval;
+
+    if (state->uring) {
+        aeUringMarkDirty(state->u.uring, fd);
+        return 0;
+    }
+    AE_EPOLL_CALL(eventLoop, state, retval = aeEpollAddEvent(eventLoop, fd, mask));
+    return retval;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->uring) {
+        if (!(eventLoop->events[fd].mask & ~delmask & (AE_READABLE|AE_WRITABLE)))
+            state->u.uring->fds[fd].reset = 1;
+        aeUringMarkDirty(state->u.uring, fd);
+        return;
+    }
+    AE_EPOLL_CALL(eventLoop, state, aeEpollDelEvent(eventLoop, fd, delmask));
+}
+
+static int aeApiModEvent(aeEventLoop *eventLoop, int fd, int oldmask, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    int retval;
+
+    if (state->uring) {
+        if (mask == AE_NONE) state->u.uring->fds[fd].reset = 1;
+        aeUringMarkDirty(state->u.uring, fd);
+        return 0;
+    }
+    AE_EPOLL_CALL(eventLoop, state, retval = aeEpollModEvent(eventLoop, fd, oldmask, mask));
+    return retval;
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    int retval;
+
+    if (state->uring) return aeUringPoll(eventLoop, state->u.uring, tvp);
+    AE_EPOLL_CALL(eventLoop, state, retval = aeEpollPoll(eventLoop, tvp));
+    return retval;
+}
+
+static char *aeApiName(void) {
+    return "io_uring";
+}
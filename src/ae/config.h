@@ -5,6 +5,11 @@
 #define HAVE_KQUEUE
 #elif defined(__linux__)
 #define HAVE_EPOLL
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
 #elif defined (__sun)
 #define HAVE_EVPORT
 #define _XPG6
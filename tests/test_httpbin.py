@@ -1,5 +1,6 @@
 import acurl
 import asyncio
+import zlib
 from urllib.parse import urlencode
 
 
@@ -62,4 +63,308 @@ def test_redirect():
     r = _await(s.get('https://httpbin.org/redirect-to?' + urlencode({'url': url})))
     assert r.url == url
 
+
+def test_loop_redirects():
+    s = session()
+    r = _await(s.get('https://httpbin.org/redirect/2', loop_redirects=True))
+    assert r.status_code == 200
+    assert [h.status_code for h in r.history] == [302, 302]
+    assert r.history[-1].redirect_url == r.url
+    r = _await(s.post('https://httpbin.org/redirect-to?' + urlencode({'url': '/anything', 'status_code': 307}),
+                      data=b'abc', loop_redirects=True))
+    assert r.json()['method'] == 'POST'
+    assert r.json()['data'] == 'abc'
+    try:
+        _await(s.get('https://httpbin.org/redirect/3', max_redirects=2, loop_redirects=True))
+    except acurl.RequestError:
+        pass
+    else:
+        assert False, 'expected RequestError'
+
     
+
+
+def test_request_error():
+    s = session()
+    try:
+        _await(s.get('http://127.0.0.1:1/'))
+    except acurl.RequestError:
+        pass
+    else:
+        assert False, 'expected RequestError'
+
+
+def test_event_loop_pool():
+    pool = acurl.EventLoopPool(2)
+    try:
+        sessions = [pool.session() for i in range(4)]
+        async def get_all():
+            return await asyncio.gather(*[s.get('https://httpbin.org/ip') for s in sessions])
+        for r in _await(get_all()):
+            assert r.status_code == 200
+    finally:
+        pool.stop()
+
+
+def test_io_uring_backend():
+    el = acurl.EventLoop(backend='io_uring')
+    try:
+        assert el.get_backend() in ('io_uring', 'epoll') # epoll when the kernel lacks io_uring
+        s = el.session()
+        r = _await(s.get('https://httpbin.org/ip'))
+        assert r.status_code == 200
+    finally:
+        el.stop()
+
+
+def test_edge_triggered_stats():
+    el = acurl.EventLoop(edge_triggered=True)
+    try:
+        s = el.session()
+        r = _await(s.get('https://httpbin.org/ip'))
+        assert r.status_code == 200
+        stats = el.get_stats()
+        assert stats['requests'] == 1
+        assert stats['registrations'] > 0 and stats['polls'] > 0 and stats['events'] > 0
+    finally:
+        el.stop()
+
+
+def test_same_thread():
+    el = acurl.EventLoop(same_thread=True)
+    try:
+        assert el.get_backend() == 'asyncio'
+        s = el.session()
+        r = _await(s.get('https://httpbin.org/ip'))
+        assert r.status_code == 200
+        assert _await(s.get_cookie_list()) == []
+    finally:
+        el.stop()
+
+
+def test_handle_pool():
+    el = acurl.EventLoop()
+    try:
+        s = el.session()
+        for i in range(3):
+            r = _await(s.get('https://httpbin.org/ip'))
+            assert r.status_code == 200
+            del r
+        stats = el.get_stats()
+        assert stats['handle_pool_hits'] >= 2 and stats['handle_pool_misses'] == 1
+        assert stats['handles_live'] == 1 and stats['curl_memory'] > 0
+    finally:
+        el.stop()
+
+
+def test_transfer_info():
+    el = acurl.EventLoop()
+    try:
+        s = el.session()
+        # Held responses don't keep their handles
+        responses = [_await(s.get('https://httpbin.org/bytes/100')) for i in range(3)]
+        assert el.get_stats()['handles_live'] == 1
+        r = responses[-1]
+        assert r.status_code == 200 and r.url == 'https://httpbin.org/bytes/100'
+        assert r.content_length == 100 and r.download_size == 100
+        assert responses[0].num_connects == 1 and r.num_connects == 0
+        assert 0 < r.starttransfer_time <= r.total_time
+        assert r.primary_ip and r.redirect_url is None
+    finally:
+        el.stop()
+
+
+def test_cancel():
+    el = acurl.EventLoop()
+    try:
+        s = el.session()
+        async def cancel_slow_request():
+            task = asyncio.ensure_future(s.get('https://httpbin.org/delay/10'))
+            await asyncio.sleep(1)
+            task.cancel()
+            try:
+                await task
+            except asyncio.CancelledError:
+                pass
+            await asyncio.sleep(0.1)
+        _await(cancel_slow_request())
+        stats = el.get_stats()
+        assert stats['cancelled'] == 1 and stats['in_flight'] == 0
+    finally:
+        el.stop()
+
+
+def test_cancel_twice():
+    el = acurl.EventLoop()
+    try:
+        s = el.session()
+        async def cancel_twice():
+            future = asyncio.get_event_loop().create_future()
+            handle = s._session.request(future, 'GET', 'https://httpbin.org/delay/10')
+            assert s._session.cancel(handle) and s._session.cancel(handle)
+            try:
+                await future
+            except asyncio.CancelledError:
+                pass
+            await asyncio.sleep(0.1)
+        _await(cancel_twice())
+        stats = el.get_stats()
+        assert stats['cancelled'] == 1 and stats['in_flight'] == 0
+    finally:
+        el.stop()
+
+
+def test_timeout():
+    s = session()
+    try:
+        _await(s.get('https://httpbin.org/delay/10', timeout=1))
+        assert False
+    except acurl.RequestTimeout as e:
+        assert e.phase == 'deadline'
+        assert isinstance(e, acurl.RequestError)
+
+
+def test_response_buffers():
+    el = acurl.EventLoop()
+    try:
+        s = el.session()
+        for i in range(3):
+            r = _await(s.get('https://httpbin.org/bytes/65536'))
+            assert len(r.body) == 65536
+            del r
+        stats = el.get_stats()
+        assert stats['buffer_allocations'] <= 4 and stats['buffers_idle'] >= 1
+    finally:
+        el.stop()
+
+
+def test_body_view():
+    s = session()
+    r = _await(s.get('https://httpbin.org/bytes/1024?seed=1'))
+    view = r.body_view
+    assert view.readonly and len(view) == 1024
+    assert bytes(view) == r.body
+    assert bytes(memoryview(r._resp)) == r.body
+
+
+def test_discard_body():
+    el = acurl.EventLoop()
+    try:
+        s = el.session(discard_body=True, checksum=True)
+        r = _await(s.get('https://httpbin.org/bytes/2048'))
+        assert r.status_code == 200
+        assert r.body == b'' and r.body_length == 2048 and r.checksum is not None
+        r = _await(s.get('https://httpbin.org/robots.txt', discard_body=False, discard_headers=True))
+        assert r.header == '' and r.checksum == zlib.adler32(r.body)
+    finally:
+        el.stop()
+
+
+def test_stream():
+    s = session()
+    async def read_stream():
+        async with s.stream('GET', 'https://httpbin.org/bytes/102400', high_water=16384) as r:
+            assert r.status_code == 200
+            assert r.headers['Content-Type'] == 'application/octet-stream'
+            body = b''
+            async for chunk in r:
+                body += chunk
+                await asyncio.sleep(0.01)
+        return body, r.response
+    body, response = _await(read_stream())
+    assert len(body) == 102400 and response.status_code == 200
+
+
+def test_sink(tmp_path):
+    s = session()
+    path = tmp_path / 'bytes'
+    r = _await(s.get('https://httpbin.org/bytes/4096', sink=str(path)))
+    assert r.status_code == 200 and r.body == b'' and r.body_length == 4096
+    assert path.stat().st_size == 4096
+    buffer = bytearray(8192)
+    r = _await(s.get('https://httpbin.org/bytes/4096', sink=buffer))
+    assert r.body_length == 4096 and buffer[4096:] == bytes(4096)
+
+
+def test_headers():
+    s = session()
+    r = _await(s.get('https://httpbin.org/response-headers?X-Test=a&x-test=b'))
+    assert r.headers['content-type'] == r.headers['Content-Type']
+    assert r.headers.content_type == 'application/json'
+    assert r.headers.getall('X-TEST') == ['a', 'b']
+    assert r.headers.status_line.endswith(' 200 OK') or r.headers.status_line == 'HTTP/2 200'
+    assert 'x-missing' not in r.headers and r.headers.get('x-missing') is None
+
+
+def test_binary_body():
+    s = session()
+    payload = bytearray(b'before\x00after')
+    r = _await(s.post('https://httpbin.org/post', data=payload, headers={'Content-Type': 'text/plain'}))
+    assert r.json()['data'] == 'before\x00after'
+
+
+def test_streamed_upload(tmp_path):
+    s = session()
+    async def chunks():
+        for i in range(4):
+            yield b'chunk%d' % i
+    r = _await(s.put('https://httpbin.org/put', data=chunks(), headers={'Content-Type': 'text/plain'}))
+    assert r.json()['data'] == 'chunk0chunk1chunk2chunk3'
+    path = tmp_path / 'body'
+    path.write_bytes(b'from a file')
+    r = _await(s.post('https://httpbin.org/post', data=path, headers={'Content-Type': 'text/plain'}))
+    assert r.json()['data'] == 'from a file'
+    with open(path, 'rb') as f:
+        f.read(5)
+        r = _await(s.post('https://httpbin.org/post', data=f, headers={'Content-Type': 'text/plain'}))
+    assert r.json()['data'] == 'a file'
+
+
+def test_memory_budget():
+    el = acurl.EventLoop(memory_budget=1 << 17)
+    try:
+        s = el.session()
+        async def one():
+            r = await s.get('https://httpbin.org/bytes/65536')
+            assert len(r.body) == 65536
+        _await(asyncio.gather(*[one() for i in range(8)]))
+        stats = el.get_stats()
+        assert stats['budget_pauses'] + stats['budget_waits'] > 0 # 8 x 64 KiB don't fit in 128 KiB
+        assert stats['buffered_bytes'] == 0 and stats['budget_paused'] == 0 and stats['budget_queued'] == 0
+        assert s.get_stats() == {'in_flight': 0, 'buffered_bytes': 0}
+    finally:
+        el.stop()
+
+
+def test_request_headers():
+    s = session()
+    r = _await(s.get('https://httpbin.org/headers', headers={'X-Dict': 'a', b'X-Bytes': b'b'}, headers_list=['X-List: c']))
+    sent = r.json()['headers']
+    assert sent['X-Dict'] == 'a' and sent['X-Bytes'] == 'b' and sent['X-List'] == 'c'
+    assert r.request.header_list == ('X-List: c', 'X-Dict: a', 'X-Bytes: b')
+    assert r.request.headers['X-Dict'] == 'a'
+
+
+def test_import_export_cookies():
+    s = session()
+    s.import_cookies([(False, 'httpbin.org', False, '/', False, 0, 'seeded', '1'),
+                      acurl.Cookie(True, '.example.com', True, '/', True, 2000000000, 'other', '2')])
+    r = _await(s.get('https://httpbin.org/cookies'))
+    assert r.json()['cookies'] == {'seeded': '1'}
+    assert sorted(s.export_cookies()) == [(False, 'httpbin.org', False, '/', False, 0, 'seeded', '1'),
+                                          (True, '.example.com', True, '/', True, 2000000000, 'other', '2')]
+    _await(s.erase_session_cookies())
+    assert [cookie.name for cookie in _await(s.get_cookie_list())] == ['other']
+
+
+def test_sessions_share_connections():
+    el = acurl.EventLoop()
+    try:
+        first, second = el.session(), el.session()
+        r = _await(first.get('https://httpbin.org/cookies/set?name=value'))
+        assert r.cookies == {'name': 'value'}
+        r = _await(second.get('https://httpbin.org/cookies'))
+        assert r.json()['cookies'] == {} and second.export_cookies() == []
+        assert r.num_connects == 0
+    finally:
+        el.stop()